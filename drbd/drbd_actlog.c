@@ -91,7 +91,7 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	device->md_io.done = 0;
 	device->md_io.error = -ENODEV;
 
-	bio = bio_alloc_drbd(GFP_NOIO);
+	bio = bio_alloc_drbd(GFP_NOIO, 1);
 	bio_set_dev(bio, bdev->md_bdev);
 	bio->bi_iter.bi_sector = sector;
 	err = -EIO;
@@ -337,13 +337,14 @@ static unsigned long al_extent_to_bm_bit(unsigned int al_enr)
 	return (unsigned long)al_enr << (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT);
 }
 
-static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
+static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device,
+		unsigned int tr_number)
 {
 	const unsigned int stripes = device->ldev->md.al_stripes;
 	const unsigned int stripe_size_4kB = device->ldev->md.al_stripe_size_4k;
 
 	/* transaction number, modulo on-disk ring buffer wrap around */
-	unsigned int t = device->al_tr_number % (device->ldev->md.al_size_4k);
+	unsigned int t = tr_number % (device->ldev->md.al_size_4k);
 
 	/* ... to aligned 4k on disk block */
 	t = ((t % stripes) * stripe_size_4kB) + t/stripes;
@@ -355,15 +356,18 @@ static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
 	return device->ldev->md.md_offset + device->ldev->md.al_offset + t;
 }
 
-static int __al_write_transaction(struct drbd_device *device, struct al_transaction_on_disk *buffer)
+/* Fills in one 4k transaction block with up to AL_UPDATES_PER_TRANSACTION
+ * of the changes pending on the activity log, starting with change @first,
+ * and marks the bitmap pages of the evicted extents for writeout.
+ * Returns the on disk sector of the block.
+ * Caller holds the activity log locked for the transaction. */
+static sector_t __al_prepare_transaction(struct drbd_device *device,
+		struct al_transaction_on_disk *buffer, unsigned int first)
 {
 	struct lc_element *e;
-	sector_t sector;
 	int i, mx;
-	unsigned extent_nr;
+	unsigned extent_nr, written;
 	unsigned crc = 0;
-	int err = 0;
-	ktime_var_for_accounting(start_kt);
 
 	memset(buffer, 0, sizeof(*buffer));
 	buffer->magic = cpu_to_be32(DRBD_AL_MAGIC);
@@ -371,18 +375,22 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 
 	i = 0;
 
-	drbd_bm_reset_al_hints(device);
+	if (first == 0)
+		drbd_bm_reset_al_hints(device);
 
 	/* Even though no one can start to change this list
 	 * once we set the LC_LOCKED -- from drbd_al_begin_io(),
 	 * lc_try_lock_for_transaction() --, someone may still
 	 * be in the process of changing it. */
 	spin_lock_irq(&device->al_lock);
+	written = first;
 	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
-		if (i == AL_UPDATES_PER_TRANSACTION) {
-			i++;
-			break;
+		if (written) {
+			written--;
+			continue;
 		}
+		if (i == AL_UPDATES_PER_TRANSACTION)
+			break;
 		buffer->update_slot_nr[i] = cpu_to_be16(e->lc_index);
 		buffer->update_extent_nr[i] = cpu_to_be32(e->lc_new_number);
 		if (e->lc_number != LC_FREE) {
@@ -394,10 +402,9 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		}
 		i++;
 	}
-	spin_unlock_irq(&device->al_lock);
-	BUG_ON(i > AL_UPDATES_PER_TRANSACTION);
 
 	buffer->n_updates = cpu_to_be16(i);
+	written = first + i;
 	for ( ; i < AL_UPDATES_PER_TRANSACTION; i++) {
 		buffer->update_slot_nr[i] = cpu_to_be16(-1);
 		buffer->update_extent_nr[i] = cpu_to_be32(LC_FREE);
@@ -406,50 +413,81 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 	buffer->context_size = cpu_to_be16(device->act_log->nr_elements);
 	buffer->context_start_slot_nr = cpu_to_be16(device->al_tr_cycle);
 
+	/* The context must not revert changes that an earlier transaction
+	 * still in flight, or an earlier block of this commit, records: they
+	 * land on disk before this block, and lc_number is only updated once
+	 * the whole commit completed.  So take the newest number, except for
+	 * the changes that are left for later blocks. */
 	mx = min_t(int, AL_CONTEXT_PER_TRANSACTION,
 		   device->act_log->nr_elements - device->al_tr_cycle);
 	for (i = 0; i < mx; i++) {
 		unsigned idx = device->al_tr_cycle + i;
-		extent_nr = lc_element_by_index(device->act_log, idx)->lc_number;
+		extent_nr = lc_element_by_index(device->act_log, idx)->lc_new_number;
 		buffer->context[i] = cpu_to_be32(extent_nr);
 	}
 	for (; i < AL_CONTEXT_PER_TRANSACTION; i++)
 		buffer->context[i] = cpu_to_be32(LC_FREE);
+	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
+		if (written) {
+			written--;
+			continue;
+		}
+		if (e->lc_index >= device->al_tr_cycle &&
+		    e->lc_index < device->al_tr_cycle + mx)
+			buffer->context[e->lc_index - device->al_tr_cycle] =
+				cpu_to_be32(e->lc_number);
+	}
+	spin_unlock_irq(&device->al_lock);
 
 	device->al_tr_cycle += AL_CONTEXT_PER_TRANSACTION;
 	if (device->al_tr_cycle >= device->act_log->nr_elements)
 		device->al_tr_cycle = 0;
 
-	sector = al_tr_number_to_on_disk_sector(device);
-
 	crc = crc32c(0, buffer, 4096);
 	buffer->crc32c = cpu_to_be32(crc);
 
-	ktime_aggregate_delta(device, start_kt, al_before_bm_write_hinted_kt);
-	if (drbd_bm_write_hinted(device))
-		err = -EIO;
-	else {
-		bool write_al_updates;
-		rcu_read_lock();
-		write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
-		rcu_read_unlock();
+	return al_tr_number_to_on_disk_sector(device, device->al_tr_number);
+}
+
+/* Writes the pending changes through @buffer, one 4k block at a time.  With
+ * more than AL_UPDATES_PER_TRANSACTION of them, al_submit_transaction() is
+ * preferred; this is its fallback. */
+static int __al_write_transaction(struct drbd_device *device, struct al_transaction_on_disk *buffer)
+{
+	unsigned int pending = device->act_log->pending_changes;
+	unsigned int first = 0;
+	bool write_al_updates;
+
+	rcu_read_lock();
+	write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
+	rcu_read_unlock();
+
+	do {
+		sector_t sector;
+		ktime_var_for_accounting(start_kt);
+
+		sector = __al_prepare_transaction(device, buffer, first);
+
+		ktime_aggregate_delta(device, start_kt, al_before_bm_write_hinted_kt);
+		if (drbd_bm_write_hinted(device))
+			return -EIO;
 		if (write_al_updates) {
 			ktime_aggregate_delta(device, start_kt, al_mid_kt);
 			if (drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE)) {
-				err = -EIO;
 				drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
-			} else {
-				device->al_tr_number++;
-				device->al_writ_cnt++;
-				device->al_histogram[min_t(unsigned int,
-						device->act_log->pending_changes,
-						AL_UPDATES_PER_TRANSACTION)]++;
+				return -EIO;
 			}
+			device->al_tr_number++;
+			device->al_writ_cnt++;
 			ktime_aggregate_delta(device, start_kt, al_after_sync_page_kt);
 		}
-	}
+		first += AL_UPDATES_PER_TRANSACTION;
+	} while (first < pending);
 
-	return err;
+	if (write_al_updates)
+		device->al_histogram[min_t(unsigned int, pending,
+					   AL_UPDATES_PER_TRANSACTION)]++;
+	return 0;
 }
 
 static int al_write_transaction(struct drbd_device *device)
@@ -495,7 +533,9 @@ bool drbd_al_try_lock(struct drbd_device *device)
 	bool locked;
 
 	spin_lock_irq(&device->al_lock);
-	locked = lc_try_lock(device->act_log);
+	/* transactions still in flight are not committed yet */
+	locked = list_empty(&device->al_transactions) &&
+		 lc_try_lock(device->act_log);
 	spin_unlock_irq(&device->al_lock);
 
 	return locked;
@@ -512,19 +552,46 @@ bool drbd_al_try_lock_for_transaction(struct drbd_device *device)
 	return locked;
 }
 
-void drbd_al_begin_io_commit(struct drbd_device *device)
+/* The synchronous path must not overtake asynchronous transactions still in
+ * flight: requests may have joined their extents with lc_get_cumulative().
+ * Asynchronous transactions are only queued while holding the activity log
+ * locked, so check again once we hold that lock ourselves. */
+static bool al_try_lock_for_sync_transaction(struct drbd_device *device)
+{
+	bool idle;
+
+	if (!list_empty(&device->al_transactions) ||
+	    !drbd_al_try_lock_for_transaction(device))
+		return false;
+
+	spin_lock_irq(&device->al_lock);
+	idle = list_empty(&device->al_transactions);
+	spin_unlock_irq(&device->al_lock);
+	if (!idle) {
+		lc_unlock(device->act_log);
+		wake_up(&device->al_wait);
+	}
+
+	return idle;
+}
+
+static int al_write_transaction_blocks(struct drbd_device *device);
+
+int drbd_al_begin_io_commit(struct drbd_device *device)
 {
 	bool locked = false;
+	int err = 0;
 
 
 	if (drbd_md_dax_active(device->ldev)) {
 		drbd_dax_al_begin_io_commit(device);
-		return;
+		return 0;
 	}
 
 	wait_event(device->al_wait,
-			device->act_log->pending_changes == 0 ||
-			(locked = drbd_al_try_lock_for_transaction(device)));
+			(device->act_log->pending_changes == 0 &&
+			 list_empty(&device->al_transactions)) ||
+			(locked = al_try_lock_for_sync_transaction(device)));
 
 	if (locked) {
 		/* Double check: it may have been committed by someone else
@@ -536,8 +603,12 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 			write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
 			rcu_read_unlock();
 
-			if (write_al_updates)
-				al_write_transaction(device);
+			if (!write_al_updates)
+				;
+			else if (device->act_log->pending_changes > AL_UPDATES_PER_TRANSACTION)
+				err = al_write_transaction_blocks(device);
+			else
+				err = al_write_transaction(device);
 			spin_lock_irq(&device->al_lock);
 			/* FIXME
 			if (err)
@@ -549,6 +620,331 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 		lc_unlock(device->act_log);
 		wake_up(&device->al_wait);
 	}
+
+	return err;
+}
+
+static void drbd_al_transaction_endio(struct bio *bio)
+{
+	struct drbd_al_transaction *tr = bio->bi_private;
+	struct drbd_device *device = tr->device;
+	unsigned long flags;
+
+	spin_lock_irqsave(&device->al_lock, flags);
+	if (bio->bi_status)
+		tr->error = blk_status_to_errno(bio->bi_status);
+	tr->done = --tr->pending_bios == 0;
+	spin_unlock_irqrestore(&device->al_lock, flags);
+	bio_put(bio);
+
+	if (tr->done)
+		queue_work(device->submit.commit_wq, &device->al_commit_work);
+}
+
+/* Commits completed transactions to the activity log in the order they have
+ * been submitted, and only then submits the requests parked on them.
+ * A transaction that completed early waits for its predecessors:
+ * requests parked on it may use extents that only those predecessors made
+ * active.  For the same reason, if a transaction failed, the ones queued
+ * behind it fail as well, and the requests parked on them are failed
+ * instead of submitted. */
+void drbd_al_commit_work(struct work_struct *ws)
+{
+	struct drbd_device *device = container_of(ws, struct drbd_device, al_commit_work);
+	struct drbd_al_transaction *tr, *next;
+	LIST_HEAD(requests);
+	LIST_HEAD(peer_requests);
+	unsigned int i;
+
+	for (;;) {
+		spin_lock_irq(&device->al_lock);
+		tr = list_first_entry_or_null(&device->al_transactions,
+				struct drbd_al_transaction, list);
+		if (!tr || !tr->done) {
+			spin_unlock_irq(&device->al_lock);
+			break;
+		}
+		spin_unlock_irq(&device->al_lock);
+
+		/* Detach before the next transaction is queued */
+		if (tr->error) {
+			drbd_err(device, "al transaction %u failed: %d\n",
+				 tr->tr_number, tr->error);
+			drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
+		}
+
+		spin_lock_irq(&device->al_lock);
+		list_del(&tr->list);
+		device->al_transactions_in_flight--;
+		if (tr->error) {
+			list_for_each_entry(next, &device->al_transactions, list) {
+				if (!next->error)
+					next->error = tr->error;
+			}
+		}
+		/* The in-core activity log stays as if the transaction had
+		 * been written.  Its requests are failed below, and the disk
+		 * is detached on the meta data error. */
+		lc_committed_list(device->act_log, &tr->changes);
+		list_splice_init(&tr->requests, &requests);
+		list_splice_init(&tr->peer_requests, &peer_requests);
+		spin_unlock_irq(&device->al_lock);
+		wake_up(&device->al_wait);
+
+		if (tr->error)
+			drbd_fail_after_al_transaction(device, &requests, &peer_requests);
+		else
+			drbd_submit_after_al_transaction(device, &requests, &peer_requests);
+		if (tr->done_sync) {
+			*tr->error_sync = tr->error;
+			complete(tr->done_sync);
+		}
+
+		for (i = 0; i < tr->n_blocks; i++)
+			mempool_free(tr->pages[i], &drbd_md_io_page_pool);
+		kfree(tr);
+		put_ldev(device);
+	}
+}
+
+static struct bio *al_transaction_bio(struct drbd_al_transaction *tr,
+		sector_t sector, unsigned int first, unsigned int n)
+{
+	struct drbd_device *device = tr->device;
+	struct bio *bio;
+	unsigned int i;
+
+	bio = bio_alloc_drbd(GFP_NOIO, n);
+	bio_set_dev(bio, device->ldev->md_bdev);
+	bio->bi_iter.bi_sector = sector;
+	for (i = first; i < first + n; i++) {
+		if (bio_add_page(bio, tr->pages[i], 4096, 0) != 4096) {
+			bio_put(bio);
+			return NULL;
+		}
+	}
+	bio->bi_private = tr;
+	bio->bi_end_io = drbd_al_transaction_endio;
+	bio->bi_opf = REQ_OP_WRITE | REQ_META | REQ_SYNC;
+	if (!test_bit(MD_NO_FUA, &device->flags))
+		bio->bi_opf |= REQ_FUA | REQ_PREFLUSH;
+	return bio;
+}
+
+/* Writes the pending changes as a new transaction, without waiting for it.
+ * If there are more than AL_UPDATES_PER_TRANSACTION of them, the transaction
+ * spans several consecutive 4k blocks of the on disk ring buffer.  Each of
+ * those is an ordinary transaction on its own, with its own tr_number, so
+ * they are read back just the same.  Blocks that are adjacent on disk go
+ * out in one bio; only striping or the ring buffer wrap around split them.
+ * Returns 0 if the requests have been parked on that transaction.  Otherwise
+ * nothing has been written nor committed, and the caller falls back to
+ * al_write_transaction(), which also reports why the disk cannot be written.
+ * Caller holds the activity log locked for the transaction. */
+static int al_submit_transaction(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests,
+		struct completion *done_sync, int *error_sync)
+{
+	sector_t sector[AL_TRANSACTION_BLOCKS_MAX];
+	struct bio *bio[AL_TRANSACTION_BLOCKS_MAX];
+	struct drbd_al_transaction *tr;
+	unsigned int n_bios = 0;
+	unsigned int i, first, tr_cycle;
+	int err = -ENOMEM;
+
+	if (!get_ldev(device))
+		return -ENODEV;
+
+	/* The bitmap write may have failed, causing a state change. */
+	if (device->disk_state[NOW] < D_INCONSISTENT) {
+		err = -EIO;
+		goto out_put;
+	}
+
+	tr = kzalloc(sizeof(*tr), GFP_NOIO);
+	if (!tr)
+		goto out_put;
+	tr->device = device;
+	INIT_LIST_HEAD(&tr->changes);
+	INIT_LIST_HEAD(&tr->requests);
+	INIT_LIST_HEAD(&tr->peer_requests);
+	tr->done_sync = done_sync;
+	tr->error_sync = error_sync;
+
+	/* lc_create() limits the pending changes to what fits */
+	tr->n_blocks = DIV_ROUND_UP(device->act_log->pending_changes,
+				    AL_UPDATES_PER_TRANSACTION);
+	BUG_ON(tr->n_blocks > AL_TRANSACTION_BLOCKS_MAX);
+
+	/* Wait for the first page only, like bm_page_io_async() does.  Waiting
+	 * for more could deadlock on the pool; rather write the blocks one by
+	 * one through the md_io buffer then. */
+	for (i = 0; i < tr->n_blocks; i++) {
+		tr->pages[i] = mempool_alloc(&drbd_md_io_page_pool, i ? GFP_NOWAIT : GFP_NOIO);
+		if (!tr->pages[i]) {
+			tr->n_blocks = i;
+			goto out_free;
+		}
+	}
+
+	/* Preparing the blocks advances al_tr_cycle and resets the bitmap
+	 * hints, so allocate the bios first, and rewind on later errors. */
+	tr->tr_number = device->al_tr_number;
+	for (i = 0; i < tr->n_blocks; i++)
+		sector[i] = al_tr_number_to_on_disk_sector(device, tr->tr_number + i);
+
+	for (first = 0, i = 1; i <= tr->n_blocks; i++) {
+		if (i < tr->n_blocks && sector[i] == sector[i - 1] + 8)
+			continue;
+		bio[n_bios] = al_transaction_bio(tr, sector[first], first, i - first);
+		if (!bio[n_bios])
+			goto out_put_bios;
+		n_bios++;
+		first = i;
+	}
+	tr->pending_bios = n_bios;
+
+	tr_cycle = device->al_tr_cycle;
+	for (i = 0; i < tr->n_blocks; i++) {
+		__al_prepare_transaction(device, page_address(tr->pages[i]),
+				i * AL_UPDATES_PER_TRANSACTION);
+		device->al_tr_number++;
+	}
+	if (drbd_bm_write_hinted(device)) {
+		err = -EIO;
+		goto out_rewind;
+	}
+
+	spin_lock_irq(&device->al_lock);
+	tr->n_changes = lc_take_pending(device->act_log, &tr->changes);
+	list_splice_tail_init(requests, &tr->requests);
+	list_splice_tail_init(peer_requests, &tr->peer_requests);
+	list_add_tail(&tr->list, &device->al_transactions);
+	device->al_transactions_in_flight++;
+	spin_unlock_irq(&device->al_lock);
+
+	device->al_writ_cnt += tr->n_blocks;
+	device->al_histogram[min_t(unsigned int, tr->n_changes,
+				   AL_UPDATES_PER_TRANSACTION)]++;
+
+	/* put_ldev() in drbd_al_commit_work() */
+	for (i = 0; i < n_bios; i++) {
+		if (drbd_insert_fault(device, DRBD_FAULT_MD_WR)) {
+			bio[i]->bi_status = BLK_STS_IOERR;
+			bio_endio(bio[i]);
+		} else {
+			submit_bio(bio[i]);
+		}
+	}
+	return 0;
+
+out_rewind:
+	/* none of the prepared blocks went out */
+	device->al_tr_number = tr->tr_number;
+	device->al_tr_cycle = tr_cycle;
+out_put_bios:
+	for (i = 0; i < n_bios; i++)
+		bio_put(bio[i]);
+out_free:
+	for (i = 0; i < tr->n_blocks; i++)
+		mempool_free(tr->pages[i], &drbd_md_io_page_pool);
+	kfree(tr);
+out_put:
+	put_ldev(device);
+	return err;
+}
+
+/* The synchronous path, for more changes than fit into one 4k block.
+ * drbd_al_commit_work() handles errors of the transaction itself, and
+ * passes them on to us. */
+static int al_write_transaction_blocks(struct drbd_device *device)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	LIST_HEAD(requests);
+	LIST_HEAD(peer_requests);
+	int err;
+
+	if (al_submit_transaction(device, &requests, &peer_requests, &done, &err))
+		return al_write_transaction(device);
+	wait_for_completion(&done);
+	return err;
+}
+
+/**
+ * drbd_al_begin_io_commit_async() - Commit pending activity log changes, without waiting
+ * @device:		DRBD device.
+ * @requests:		requests to submit once the transaction is on stable storage
+ * @peer_requests:	peer requests to submit once the transaction is on stable storage
+ *
+ * With al_pipeline_depth > 1, up to that many transactions may be in flight,
+ * and the next one can be prepared while earlier ones are still being written.
+ * Returns true if the (peer) requests have been taken over, to be submitted by
+ * drbd_al_commit_work(). Returns false if the caller can submit them right away.
+ */
+bool drbd_al_begin_io_commit_async(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests)
+{
+	struct drbd_al_transaction *tr;
+	bool write_al_updates;
+	bool locked = false;
+	bool parked = false;
+	int err;
+
+	if (drbd_al_pipeline_depth <= 1 || drbd_md_dax_active(device->ldev))
+		goto sync;
+
+	rcu_read_lock();
+	write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
+	rcu_read_unlock();
+	if (!write_al_updates)
+		goto sync;
+
+	wait_event(device->al_wait,
+			device->act_log->pending_changes == 0 ||
+			(READ_ONCE(device->al_transactions_in_flight) < drbd_al_pipeline_depth &&
+			 (locked = drbd_al_try_lock_for_transaction(device))));
+
+	if (locked) {
+		/* Double check: it may have been committed by someone else
+		 * while we were waiting for the lock. */
+		if (device->act_log->pending_changes &&
+		    !al_submit_transaction(device, requests, peer_requests, NULL, NULL))
+			parked = true;
+		else if (device->act_log->pending_changes)
+			goto fallback;
+		lc_unlock(device->act_log);
+		wake_up(&device->al_wait);
+		if (parked)
+			return true;
+	}
+
+	/* Nothing (left) to commit. But the extents of our requests may have
+	 * been made active by a transaction still in flight. */
+	spin_lock_irq(&device->al_lock);
+	if (!list_empty(&device->al_transactions)) {
+		tr = list_last_entry(&device->al_transactions,
+				struct drbd_al_transaction, list);
+		list_splice_tail_init(requests, &tr->requests);
+		list_splice_tail_init(peer_requests, &tr->peer_requests);
+		parked = true;
+	}
+	spin_unlock_irq(&device->al_lock);
+	return parked;
+
+fallback:
+	/* Earlier transactions may still be in flight.  Ours must not
+	 * overtake them, so let the synchronous path wait for them.
+	 * Report its errors like drbd_al_commit_work() does. */
+	lc_unlock(device->act_log);
+	wake_up(&device->al_wait);
+	err = drbd_al_begin_io_commit(device);
+	if (err)
+		drbd_err(device, "al transaction failed: %d\n", err);
+	return false;
+
+sync:
+	drbd_al_begin_io_commit(device);
+	return false;
 }
 
 static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last)
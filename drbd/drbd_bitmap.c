@@ -20,6 +20,7 @@
 #include <linux/dynamic_debug.h>
 #include <linux/libnvdimm.h>
 #include <asm/kmap_types.h>
+#include <asm/unaligned.h>
 
 #include "drbd_int.h"
 #include "drbd_dax_pmem.h"
@@ -248,39 +249,48 @@ static unsigned long bm_page_to_idx(struct page *page)
 	return page_private(page) & BM_PAGE_IDX_MASK;
 }
 
+/* The flags above live in page_private() of the in-core bitmap pages.
+ * With BM_CONTIGUOUS, in-core pages do not correspond to on-disk pages,
+ * so the flags are kept per on-disk page in bm_disk_page_flags instead.
+ * All page_nr arguments below are on-disk page numbers. */
+static unsigned long *bm_page_flags(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return &bitmap->bm_disk_page_flags[page_nr];
+	return &page_private(bitmap->bm_pages[page_nr]);
+}
+
 /* As is very unlikely that the same page is under IO from more than one
  * context, we can get away with a bit per page and one wait queue per bitmap.
  */
 static void bm_page_lock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = bm_page_flags(b, page_nr);
 	wait_event(b->bm_io_wait, !test_and_set_bit(BM_PAGE_IO_LOCK, addr));
 }
 
 static void bm_page_unlock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = bm_page_flags(b, page_nr);
 	clear_bit_unlock(BM_PAGE_IO_LOCK, addr);
 	wake_up(&device->bitmap->bm_io_wait);
 }
 
 /* set _before_ submit_io, so it may be reset due to being changed
  * while this page is in flight... will get submitted later again */
-static void bm_set_page_unchanged(struct page *page)
+static void bm_set_page_unchanged(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
 	/* use cmpxchg? */
-	clear_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	clear_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+	clear_bit(BM_PAGE_NEED_WRITEOUT, bm_page_flags(bitmap, page_nr));
+	clear_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_flags(bitmap, page_nr));
 }
 
 static void bm_set_page_need_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	}
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
+		set_bit(BM_PAGE_NEED_WRITEOUT, bm_page_flags(bitmap, page_nr));
 }
 
 void drbd_bm_reset_al_hints(struct drbd_device *device)
@@ -288,33 +298,31 @@ void drbd_bm_reset_al_hints(struct drbd_device *device)
 	device->bitmap->n_bitmap_hints = 0;
 }
 
-static int bm_test_page_unchanged(struct page *page)
+static int bm_test_page_unchanged(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	volatile const unsigned long *addr = &page_private(page);
+	volatile const unsigned long *addr = bm_page_flags(bitmap, page_nr);
 	return (*addr & ((1UL<<BM_PAGE_NEED_WRITEOUT)|(1UL<<BM_PAGE_LAZY_WRITEOUT))) == 0;
 }
 
-static void bm_set_page_io_err(struct page *page)
+static void bm_set_page_io_err(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	set_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	set_bit(BM_PAGE_IO_ERROR, bm_page_flags(bitmap, page_nr));
 }
 
-static void bm_clear_page_io_err(struct page *page)
+static void bm_clear_page_io_err(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	clear_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	clear_bit(BM_PAGE_IO_ERROR, bm_page_flags(bitmap, page_nr));
 }
 
 static void bm_set_page_lazy_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
-	}
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
+		set_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_flags(bitmap, page_nr));
 }
 
-static int bm_test_page_lazy_writeout(struct page *page)
+static int bm_test_page_lazy_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	return test_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+	return test_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_flags(bitmap, page_nr));
 }
 
 /*
@@ -341,6 +349,21 @@ static void bm_free_pages(struct page **pages, unsigned long number)
 	}
 }
 
+static void *bm_kvzalloc(unsigned long bytes)
+{
+	void *p;
+
+	/* Trying kmalloc first, falling back to vmalloc.
+	 * GFP_NOIO, as this is called while drbd IO is "suspended",
+	 * and during resize or attach on diskless Primary,
+	 * we must not block on IO to ourselves.
+	 * Context is receiver thread or dmsetup. */
+	p = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!p)
+		p = __vmalloc(bytes, GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO, PAGE_KERNEL);
+	return p;
+}
+
 /*
  * "have" and "want" are NUMBER OF PAGES.
  */
@@ -348,7 +371,7 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 {
 	struct page **old_pages = b->bm_pages;
 	struct page **new_pages, *page;
-	unsigned int i, bytes;
+	unsigned int i;
 	unsigned long have = b->bm_number_of_pages;
 
 	BUG_ON(have == 0 && old_pages != NULL);
@@ -357,20 +380,9 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	if (have == want)
 		return old_pages;
 
-	/* Trying kmalloc first, falling back to vmalloc.
-	 * GFP_NOIO, as this is called while drbd IO is "suspended",
-	 * and during resize or attach on diskless Primary,
-	 * we must not block on IO to ourselves.
-	 * Context is receiver thread or dmsetup. */
-	bytes = sizeof(struct page *)*want;
-	new_pages = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
-	if (!new_pages) {
-		new_pages = __vmalloc(bytes,
-				GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO,
-				PAGE_KERNEL);
-		if (!new_pages)
-			return NULL;
-	}
+	new_pages = bm_kvzalloc(sizeof(struct page *) * want);
+	if (!new_pages)
+		return NULL;
 
 	if (want >= have) {
 		for (i = 0; i < have; i++)
@@ -397,6 +409,57 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	return new_pages;
 }
 
+/*
+ * With BM_CONTIGUOUS, each bitmap slot keeps its own range of slot_pages
+ * pages.  As with bm_realloc_pages(), the pages no longer needed by a
+ * shrinking bitmap are freed by the caller, within the spinlock.
+ */
+static struct page **bm_realloc_pages_contiguous(struct drbd_bitmap *b, unsigned long slot_pages)
+{
+	struct page **old_pages = b->bm_pages;
+	unsigned long have = b->bm_slot_pages;
+	unsigned long copy = min(have, slot_pages);
+	struct page **new_pages, *page;
+	unsigned int bitmap_index;
+	unsigned long i;
+
+	BUG_ON(have == 0 && old_pages != NULL);
+	BUG_ON(have != 0 && old_pages == NULL);
+
+	if (have == slot_pages)
+		return old_pages;
+
+	new_pages = bm_kvzalloc(sizeof(struct page *) * slot_pages * b->bm_max_peers);
+	if (!new_pages)
+		return NULL;
+
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		struct page **slot = new_pages + bitmap_index * slot_pages;
+
+		for (i = 0; i < copy; i++)
+			slot[i] = old_pages[bitmap_index * have + i];
+		for (; i < slot_pages; i++) {
+			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+			if (!page)
+				goto fail;
+			bm_store_page_idx(page, bitmap_index * slot_pages + i);
+			slot[i] = page;
+		}
+	}
+	return new_pages;
+
+fail:
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+		for (i = copy; i < slot_pages; i++) {
+			page = new_pages[bitmap_index * slot_pages + i];
+			if (page)
+				__free_page(page);
+		}
+	}
+	kvfree(new_pages);
+	return NULL;
+}
+
 struct drbd_bitmap *drbd_bm_alloc(void)
 {
 	struct drbd_bitmap *b;
@@ -428,6 +491,8 @@ void drbd_bm_free(struct drbd_bitmap *bitmap)
 
 	bm_free_pages(bitmap->bm_pages, bitmap->bm_number_of_pages);
 	kvfree(bitmap->bm_pages);
+	kvfree(bitmap->bm_page_weight);
+	kvfree(bitmap->bm_disk_page_flags);
 	kfree(bitmap);
 }
 
@@ -448,13 +513,38 @@ static inline unsigned int word32_in_page(unsigned long word)
 	return word & ((1 << (PAGE_SHIFT - 2)) - 1);
 }
 
+/* The in core position of a bit; identical to the on disk position
+ * unless the bitmap is kept BM_CONTIGUOUS. */
+static inline unsigned long bm_word32(struct drbd_bitmap *bitmap,
+				      unsigned int bitmap_index,
+				      unsigned long bit)
+{
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return ((unsigned long)bitmap_index * bitmap->bm_slot_pages << (PAGE_SHIFT - 2)) +
+			(bit >> 5);
+	return interleaved_word32(bitmap, bitmap_index, bit);
+}
+
+/* distance between consecutive 32 bit words of one bitmap slot */
+static inline unsigned int bm_word32_stride(struct drbd_bitmap *bitmap)
+{
+	return (bitmap->bm_flags & BM_CONTIGUOUS) ? 1 : bitmap->bm_max_peers;
+}
+
 static inline unsigned long last_bit_on_page(struct drbd_bitmap *bitmap,
 					     unsigned int bitmap_index,
 					     unsigned long bit)
 {
-	unsigned long word = interleaved_word32(bitmap, bitmap_index, bit);
+	unsigned long word = bm_word32(bitmap, bitmap_index, bit);
 
-	return (bit | 31) + ((word32_in_page(-(word + 1)) / bitmap->bm_max_peers) << 5);
+	return (bit | 31) + ((word32_in_page(-(word + 1)) / bm_word32_stride(bitmap)) << 5);
+}
+
+static inline unsigned long bit_to_page(struct drbd_bitmap *bitmap,
+					unsigned int bitmap_index,
+					unsigned long bit)
+{
+	return word32_to_page(bm_word32(bitmap, bitmap_index, bit));
 }
 
 static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
@@ -464,6 +554,63 @@ static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
 }
 
+/* number of pages of the on disk bitmap, which is always interleaved */
+static inline unsigned long bm_number_of_disk_pages(struct drbd_bitmap *bitmap)
+{
+	if (!(bitmap->bm_flags & BM_CONTIGUOUS))
+		return bitmap->bm_number_of_pages;
+	return ALIGN(bitmap->bm_words * sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
+}
+
+/* First bit of slot bitmap_index at or after the start of in core page page,
+ * or bm_bits if there is none. */
+static unsigned long bm_page_to_bit(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+				    unsigned long page)
+{
+	unsigned long bit;
+
+	if (bitmap->bm_flags & BM_CONTIGUOUS) {
+		unsigned long first_page = bitmap_index * bitmap->bm_slot_pages;
+
+		bit = page <= first_page ? 0 : (page - first_page) * BITS_PER_PAGE;
+	} else {
+		unsigned long word = page << (PAGE_SHIFT - 2);
+		unsigned int max_peers = bitmap->bm_max_peers;
+
+		bit = word <= bitmap_index ? 0 :
+			((word - bitmap_index + max_peers - 1) / max_peers) << 5;
+	}
+	return min(bit, bitmap->bm_bits);
+}
+
+/* The per page weights allow to skip pages without any bit set for a given
+ * bitmap slot, without mapping them. Find, count, and clear operations are
+ * then proportional to the number of pages with bits set, not the device size.
+ * They are updated whenever ____bm_op() changes bits, and recalculated by
+ * bm_count_bits(). */
+static inline unsigned int *bm_page_weight(struct drbd_bitmap *bitmap,
+					   unsigned int bitmap_index,
+					   unsigned int page)
+{
+	/* with BM_CONTIGUOUS, each page belongs to exactly one slot */
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return &bitmap->bm_page_weight[page];
+	return &bitmap->bm_page_weight[(unsigned long)bitmap_index * bitmap->bm_number_of_pages + page];
+}
+
+static inline unsigned long bm_number_of_page_weights(struct drbd_bitmap *bitmap,
+						      unsigned long pages)
+{
+	if (bitmap->bm_flags & BM_CONTIGUOUS)
+		return pages;
+	return pages * bitmap->bm_max_peers;
+}
+
+static unsigned int *bm_alloc_page_weights(unsigned long number)
+{
+	return bm_kvzalloc(sizeof(unsigned int) * number);
+}
+
 static void *bm_map(struct drbd_bitmap *bitmap, unsigned int page)
 {
 	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
@@ -478,20 +625,74 @@ static void bm_unmap(struct drbd_bitmap *bitmap, void *addr)
 		kunmap_atomic(addr);
 }
 
+/* Flag the on disk pages holding bits first_bit to last_bit of bitmap slot
+ * bitmap_index, which were changed on in core page page. */
+static void bm_set_pages_writeout(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+				  unsigned int page, unsigned long first_bit,
+				  unsigned long last_bit, bool lazy)
+{
+	unsigned int last_page = page;
+
+	if (bitmap->bm_flags & BM_CONTIGUOUS) {
+		page = bit_to_page_interleaved(bitmap, bitmap_index, first_bit);
+		last_page = bit_to_page_interleaved(bitmap, bitmap_index, last_bit);
+	}
+	for (; page <= last_page; page++) {
+		if (lazy)
+			bm_set_page_lazy_writeout(bitmap, page);
+		else
+			bm_set_page_need_writeout(bitmap, page);
+	}
+}
+
+/* Number of bits of slot bitmap_index on in core page page. */
+static unsigned long bm_page_slot_bits(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+				       unsigned long page)
+{
+	unsigned long first_bit = bm_page_to_bit(bitmap, bitmap_index, page);
+
+	if (first_bit >= bitmap->bm_bits)
+		return 0;
+	return min(last_bit_on_page(bitmap, bitmap_index, first_bit), bitmap->bm_bits - 1) + 1 -
+		first_bit;
+}
+
+/* Apply a CLEAR, SET or COUNT to the bits of one word selected by mask.
+ * Returns the number of bits changed, or set for BM_OP_COUNT. */
+static __always_inline unsigned int
+bm_word32_op(__le32 *p, u32 mask, enum bitmap_operations op)
+{
+	u32 word = le32_to_cpu(*p);
+
+	switch(op) {
+	case BM_OP_CLEAR:
+		*p = cpu_to_le32(word & ~mask);
+		return hweight32(word & mask);
+	case BM_OP_SET:
+		*p = cpu_to_le32(word | mask);
+		return hweight32(~word & mask);
+	case BM_OP_COUNT:
+		return hweight32(word & mask);
+	default:
+		BUG();
+	}
+	return 0;
+}
+
 static __always_inline unsigned long
 ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
 	 enum bitmap_operations op, __le32 *buffer)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int word32_skip = 32 * bitmap->bm_max_peers;
+	unsigned int word32_skip = 32 * bm_word32_stride(bitmap);
 	unsigned long total = 0;
-	unsigned long word;
+	unsigned long word, first_bit;
 	unsigned int page, bit_in_page;
 
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
-	word = interleaved_word32(bitmap, bitmap_index, start);
+	word = bm_word32(bitmap, bitmap_index, start);
 	page = word32_to_page(word);
 	bit_in_page = (word32_in_page(word) << 5) | (start & 31);
 
@@ -499,35 +700,81 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		unsigned int count = 0;
 		void *addr;
 
+		if (bitmap->bm_flags & BM_PAGE_WEIGHTS_VALID) {
+			unsigned int weight = *bm_page_weight(bitmap, bitmap_index, page);
+			bool skip = false;
+
+			switch(op) {
+			case BM_OP_CLEAR:
+			case BM_OP_FIND_BIT:
+				skip = weight == 0;
+				break;
+			case BM_OP_FIND_ZERO_BIT:
+				/* all bits of this slot on the page set */
+				skip = weight && weight == bm_page_slot_bits(bitmap, bitmap_index, page);
+				break;
+			case BM_OP_COUNT:
+				/* nothing set, or all bits of this slot on the page in range */
+				skip = weight == 0 ||
+					((start == 0 ||
+					  bit_to_page(bitmap, bitmap_index, start - 1) != page) &&
+					 last_bit_on_page(bitmap, bitmap_index, start) <= end);
+				if (skip)
+					total += weight;
+				break;
+			default:
+				break;
+			}
+			if (skip && op != BM_OP_COUNT) {
+				/* Run over all following pages that are just
+				 * as empty (or, looking for a zero bit, just as
+				 * full) in one go, looking at their weights
+				 * only.  Finding the next set bit, e.g. for the
+				 * bitmap exchange on connect, then costs next
+				 * to nothing for the huge clean areas of a
+				 * mostly in sync device. */
+				unsigned long last_page = bit_to_page(bitmap, bitmap_index, end);
+
+				while (page < last_page) {
+					unsigned int next = *bm_page_weight(bitmap, bitmap_index, page + 1);
+
+					if (op == BM_OP_FIND_ZERO_BIT ?
+					    !next || next != bm_page_slot_bits(bitmap, bitmap_index, page + 1) :
+					    next)
+						break;
+					page++;
+				}
+				start = bm_page_to_bit(bitmap, bitmap_index, page + 1);
+			} else if (skip) {
+				start = last_bit_on_page(bitmap, bitmap_index, start) + 1;
+			}
+			if (skip) {
+				word = bm_word32(bitmap, bitmap_index, start);
+				bit_in_page = word32_in_page(word) << 5;
+				continue;
+			}
+		}
+
+		first_bit = start;
 		addr = bm_map(bitmap, page);
 		if (((start & 31) && (start | 31) <= end) || op == BM_OP_TEST) {
 			unsigned int last = bit_in_page | 31;
+			__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
+			u32 mask = ~0U << (bit_in_page & 31);
 
 			switch(op) {
-			default:
-				do {
-					switch(op) {
-					case BM_OP_CLEAR:
-						if (__test_and_clear_bit_le(bit_in_page, addr))
-							count++;
-						break;
-					case BM_OP_SET:
-						if (!__test_and_set_bit_le(bit_in_page, addr))
-							count++;
-						break;
-					case BM_OP_COUNT:
-						if (test_bit_le(bit_in_page, addr))
-							total++;
-						break;
-					case BM_OP_TEST:
-						total = !!test_bit_le(bit_in_page, addr);
-						bm_unmap(bitmap, addr);
-						return total;
-					default:
-						break;
-					}
-					bit_in_page++;
-				} while (bit_in_page <= last);
+			case BM_OP_TEST:
+				total = !!test_bit_le(bit_in_page, addr);
+				bm_unmap(bitmap, addr);
+				return total;
+			case BM_OP_CLEAR:
+			case BM_OP_SET:
+				count += bm_word32_op(p, mask, op);
+				bit_in_page = last + 1;
+				break;
+			case BM_OP_COUNT:
+				total += bm_word32_op(p, mask, op);
+				bit_in_page = last + 1;
 				break;
 			case BM_OP_MERGE:
 			case BM_OP_EXTRACT:
@@ -555,6 +802,57 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		while (start + 31 <= end) {
 			__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
 
+			/* With the words of this slot adjacent in memory, do
+			 * aligned pairs of words at once.  Bitwise operations
+			 * do not care for the byte order here. */
+			if (BITS_PER_LONG == 64 && word32_skip == 32 &&
+			    !(bit_in_page & 63) && start + 63 <= end) {
+				u64 *p64 = (u64 *)addr + (bit_in_page >> 6);
+				u64 b;
+
+				switch(op) {
+				case BM_OP_CLEAR:
+					count += hweight64(*p64);
+					*p64 = 0;
+					break;
+				case BM_OP_SET:
+					count += hweight64(~*p64);
+					*p64 = -1;
+					break;
+				case BM_OP_TEST:
+					BUG();
+					break;
+				case BM_OP_COUNT:
+					total += hweight64(*p64);
+					break;
+				case BM_OP_MERGE:
+					b = get_unaligned((u64 *)buffer);
+					count += hweight64(~*p64 & b);
+					*p64 |= b;
+					buffer += 2;
+					break;
+				case BM_OP_EXTRACT:
+					put_unaligned(*p64, (u64 *)buffer);
+					buffer += 2;
+					break;
+				case BM_OP_FIND_BIT:
+					count = find_next_bit_le(addr, bit_in_page + 64, bit_in_page);
+					if (count < bit_in_page + 64)
+						goto found;
+					break;
+				case BM_OP_FIND_ZERO_BIT:
+					count = find_next_zero_bit_le(addr, bit_in_page + 64, bit_in_page);
+					if (count < bit_in_page + 64)
+						goto found;
+					break;
+				}
+				start += 64;
+				bit_in_page += 64;
+				if (bit_in_page >= BITS_PER_PAGE)
+					goto next_page;
+				continue;
+			}
+
 			switch(op) {
 			case BM_OP_CLEAR:
 				count += hweight32(*p);
@@ -599,27 +897,23 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		if (start > end)
 			goto next_page;
 
+		/* less than one word left, within a single word */
 		switch(op) {
-		default:
-			while (start <= end) {
-				switch(op) {
-				case BM_OP_CLEAR:
-					if (__test_and_clear_bit_le(bit_in_page, addr))
-						count++;
-					break;
-				case BM_OP_SET:
-					if (!__test_and_set_bit_le(bit_in_page, addr))
-						count++;
-					break;
-				case BM_OP_COUNT:
-					if (test_bit_le(bit_in_page, addr))
-						total++;
-					break;
-				default:
-					break;
-				}
-				start++;
-				bit_in_page++;
+		case BM_OP_TEST:
+			BUG();
+			break;
+		case BM_OP_CLEAR:
+		case BM_OP_SET:
+		case BM_OP_COUNT:
+			{
+				__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
+				u32 mask = (~0U >> (31 - (end - start))) << (bit_in_page & 31);
+
+				if (op == BM_OP_COUNT)
+					total += bm_word32_op(p, mask, op);
+				else
+					count += bm_word32_op(p, mask, op);
+				start = end + 1;
 			}
 			break;
 		case BM_OP_MERGE:
@@ -668,14 +962,20 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		switch(op) {
 		case BM_OP_CLEAR:
 			if (count) {
-				bm_set_page_lazy_writeout(bitmap, page);
+				bm_set_pages_writeout(bitmap, bitmap_index, page,
+						      first_bit, start - 1, true);
+				if (bitmap->bm_page_weight)
+					*bm_page_weight(bitmap, bitmap_index, page) -= count;
 				total += count;
 			}
 			break;
 		case BM_OP_SET:
 		case BM_OP_MERGE:
 			if (count) {
-				bm_set_page_need_writeout(bitmap, page);
+				bm_set_pages_writeout(bitmap, bitmap_index, page,
+						      first_bit, start - 1, false);
+				if (bitmap->bm_page_weight)
+					*bm_page_weight(bitmap, bitmap_index, page) += count;
 				total += count;
 			}
 			break;
@@ -689,15 +989,6 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		return start + count - bit_in_page;
 	}
 	switch(op) {
-	case BM_OP_CLEAR:
-		if (total)
-			bitmap->bm_set[bitmap_index] -= total;
-		break;
-	case BM_OP_SET:
-	case BM_OP_MERGE:
-		if (total)
-			bitmap->bm_set[bitmap_index] += total;
-		break;
 	case BM_OP_FIND_BIT:
 	case BM_OP_FIND_ZERO_BIT:
 		total = DRBD_END_OF_BITMAP;
@@ -714,6 +1005,7 @@ __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long sta
 	enum bitmap_operations op, __le32 *buffer)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long count;
 
 	if (!expect(device, bitmap))
 		return 1;
@@ -744,7 +1036,22 @@ __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long sta
 			break;
 		}
 	}
-	return ____bm_op(device, bitmap_index, start, end, op, buffer);
+	count = ____bm_op(device, bitmap_index, start, end, op, buffer);
+
+	/* ____bm_op() leaves bm_set alone, so that bm_parallel_count() may
+	 * use it on disjoint pages concurrently. */
+	switch(op) {
+	case BM_OP_CLEAR:
+		bitmap->bm_set[bitmap_index] -= count;
+		break;
+	case BM_OP_SET:
+	case BM_OP_MERGE:
+		bitmap->bm_set[bitmap_index] += count;
+		break;
+	default:
+		break;
+	}
+	return count;
 }
 
 static __always_inline unsigned long
@@ -792,27 +1099,123 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 	____bm_op(device, bitmap_index, start, end, op, buffer)
 #endif
 
-/* you better not modify the bitmap while this is running,
- * or its results will be stale */
-static void bm_count_bits(struct drbd_device *device)
+/* Count the bits of all slots on in core pages first_page to last_page, and
+ * store the page weights.  Does not touch bm_set; bits[] is incremented by
+ * the bits counted per slot instead. */
+static void bm_pages_count(struct drbd_device *device,
+			   unsigned long first_page, unsigned long last_page, unsigned long *bits)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned int bitmap_index;
 
 	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
-		unsigned long bit = 0, bits_set = 0;
+		unsigned long bit = bm_page_to_bit(bitmap, bitmap_index, first_page);
+		unsigned long stop = bm_page_to_bit(bitmap, bitmap_index, last_page + 1);
 
-		while (bit < bitmap->bm_bits) {
+		while (bit < stop) {
 			unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
-
-			bits_set += ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
+			unsigned long n;
+
+			if (last_bit >= stop)
+				last_bit = stop - 1;
+			n = ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
+			if (bitmap->bm_page_weight)
+				*bm_page_weight(bitmap, bitmap_index,
+						bit_to_page(bitmap, bitmap_index, bit)) = n;
+			bits[bitmap_index] += n;
 			bit = last_bit + 1;
 			cond_resched();
 		}
-		bitmap->bm_set[bitmap_index] = bits_set;
 	}
 }
 
+/* Do not bother to split bitmaps smaller than this (in pages) */
+#define BM_PARALLEL_MIN_PAGES 256
+
+struct bm_parallel_work {
+	struct work_struct work;
+	struct drbd_device *device;
+	unsigned long first_page, last_page;
+	unsigned long bits[DRBD_PEERS_MAX];
+	atomic_t *pending;
+	struct completion *done;
+};
+
+static void bm_parallel_work_fn(struct work_struct *ws)
+{
+	struct bm_parallel_work *w = container_of(ws, struct bm_parallel_work, work);
+
+	bm_pages_count(w->device, w->first_page, w->last_page, w->bits);
+	if (atomic_dec_and_test(w->pending))
+		complete(w->done);
+}
+
+/* Split the in core pages into one range per online CPU, count them on
+ * drbd_bm_wq, and sum up the per slot results in bits[].  We may be called
+ * with IO suspended, e.g. on attach, so that workqueue has a rescuer.  Falls
+ * back to doing it all in the calling context for small bitmaps, or if we
+ * cannot allocate. */
+static void bm_parallel_count(struct drbd_device *device, unsigned long *bits)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long pages = bitmap->bm_number_of_pages;
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bm_parallel_work *works = NULL;
+	unsigned int i, bitmap_index, chunks;
+	atomic_t pending;
+
+	if (!pages)
+		return;
+
+	chunks = min_t(unsigned long, num_online_cpus(),
+		       DIV_ROUND_UP(pages, BM_PARALLEL_MIN_PAGES));
+	if (chunks > 1)
+		works = kcalloc(chunks, sizeof(*works), GFP_NOIO);
+	if (!works) {
+		bm_pages_count(device, 0, pages - 1, bits);
+		return;
+	}
+
+	atomic_set(&pending, chunks);
+	for (i = 0; i < chunks; i++) {
+		struct bm_parallel_work *w = &works[i];
+
+		INIT_WORK(&w->work, bm_parallel_work_fn);
+		w->device = device;
+		w->first_page = pages * i / chunks;
+		w->last_page = pages * (i + 1) / chunks - 1;
+		w->pending = &pending;
+		w->done = &done;
+		queue_work(drbd_bm_wq, &w->work);
+	}
+	wait_for_completion(&done);
+
+	for (i = 0; i < chunks; i++)
+		for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
+			bits[bitmap_index] += works[i].bits[bitmap_index];
+	kfree(works);
+}
+
+/* you better not modify the bitmap while this is running,
+ * or its results will be stale */
+static void bm_count_bits(struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long bits_set[DRBD_PEERS_MAX] = { };
+	unsigned int bitmap_index;
+
+	/* recalculate the page weights, do not trust them while doing so */
+	bitmap->bm_flags &= ~BM_PAGE_WEIGHTS_VALID;
+	if (bitmap->bm_page_weight)
+		memset(bitmap->bm_page_weight, 0, sizeof(unsigned int) *
+		       bm_number_of_page_weights(bitmap, bitmap->bm_number_of_pages));
+	bm_parallel_count(device, bits_set);
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
+		bitmap->bm_set[bitmap_index] = bits_set[bitmap_index];
+	if (bitmap->bm_page_weight)
+		bitmap->bm_flags |= BM_PAGE_WEIGHTS_VALID;
+}
+
 /* For the layout, see comment above drbd_md_set_sector_offsets(). */
 static u64 drbd_md_on_disk_bits(struct drbd_device *device)
 {
@@ -843,10 +1246,13 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	struct drbd_bitmap *b = device->bitmap;
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
+	unsigned long slot_pages, oslot_pages, disk_pages, odisk_pages = 0;
 	struct page **npages = NULL, **opages = NULL;
+	unsigned int *nweights = NULL, *oweights = NULL;
+	unsigned long *ndflags = NULL, *odflags = NULL;
 	void *bm_on_pmem = NULL;
 	int err = 0;
-	bool growing;
+	bool growing, recount = false;
 
 	if (!expect(device, b))
 		return -ENOMEM;
@@ -867,6 +1273,12 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		onpages = b->bm_number_of_pages;
 		b->bm_pages = NULL;
 		b->bm_number_of_pages = 0;
+		oweights = b->bm_page_weight;
+		b->bm_page_weight = NULL;
+		b->bm_flags &= ~BM_PAGE_WEIGHTS_VALID;
+		odflags = b->bm_disk_page_flags;
+		b->bm_disk_page_flags = NULL;
+		b->bm_slot_pages = 0;
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
 			b->bm_set[bitmap_index] = 0;
 		b->bm_bits = 0;
@@ -877,6 +1289,8 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 			bm_free_pages(opages, onpages);
 			kvfree(opages);
 		}
+		kvfree(oweights);
+		kvfree(odflags);
 		goto out;
 	}
 	bits  = BM_SECT_TO_BIT(ALIGN(capacity, BM_SECT_PER_BIT));
@@ -893,8 +1307,36 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		}
 	}
 
-	want = ALIGN(words*sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
 	have = b->bm_number_of_pages;
+	/* The in core layout is chosen when the bitmap is first populated.
+	 * A bitmap on DAX PMEM is used in place, it stays interleaved. */
+	if (have == 0) {
+		if (drbd_contiguous_bitmap && !drbd_md_dax_active(device->ldev))
+			b->bm_flags |= BM_CONTIGUOUS;
+		else
+			b->bm_flags &= ~BM_CONTIGUOUS;
+	}
+
+	disk_pages = ALIGN(words*sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
+	oslot_pages = b->bm_slot_pages;
+	slot_pages = ALIGN(ALIGN(bits, 64) / 8, PAGE_SIZE) >> PAGE_SHIFT;
+	if (b->bm_flags & BM_CONTIGUOUS) {
+		want = slot_pages * b->bm_max_peers;
+
+		odisk_pages = bm_number_of_disk_pages(b);
+		ndflags = b->bm_disk_page_flags;
+		if (disk_pages != odisk_pages || !ndflags) {
+			ndflags = bm_kvzalloc(sizeof(unsigned long) * disk_pages);
+			if (!ndflags) {
+				err = -ENOMEM;
+				goto out;
+			}
+		}
+	} else {
+		want = disk_pages;
+		slot_pages = 0;
+	}
+
 	if (drbd_md_dax_active(device->ldev)) {
 		bm_on_pmem = drbd_dax_bitmap(device, want);
 	} else {
@@ -904,21 +1346,54 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		} else {
 			if (drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC))
 				npages = NULL;
+			else if (b->bm_flags & BM_CONTIGUOUS)
+				npages = bm_realloc_pages_contiguous(b, slot_pages);
 			else
 				npages = bm_realloc_pages(b, want);
 		}
 
 		if (!npages) {
+			if (ndflags != b->bm_disk_page_flags)
+				kvfree(ndflags);
 			err = -ENOMEM;
 			goto out;
 		}
 	}
 
+	/* Not fatal, without it we just cannot skip over empty pages. */
+	nweights = b->bm_page_weight;
+	if (want != have || !nweights) {
+		nweights = bm_alloc_page_weights(bm_number_of_page_weights(b, want));
+		if (!nweights)
+			drbd_warn(device, "could not allocate bitmap page weights\n");
+	}
+
 	spin_lock_irq(&b->bm_lock);
 	obits  = b->bm_bits;
 
 	growing = bits > obits;
 
+	oweights = b->bm_page_weight;
+	if (nweights != oweights) {
+		if (nweights && oweights && (b->bm_flags & BM_PAGE_WEIGHTS_VALID) &&
+		    !(b->bm_flags & BM_CONTIGUOUS)) {
+			unsigned int bitmap_index;
+
+			for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+				memcpy(nweights + bitmap_index * want,
+				       oweights + bitmap_index * have,
+				       sizeof(unsigned int) * min(want, have));
+		} else if (nweights && have == 0) {
+			/* all zero, just like the freshly allocated pages */
+			b->bm_flags |= BM_PAGE_WEIGHTS_VALID;
+		} else {
+			/* nothing valid to start from */
+			b->bm_flags &= ~BM_PAGE_WEIGHTS_VALID;
+			recount = true;
+		}
+		b->bm_page_weight = nweights;
+	}
+
 	if (bm_on_pmem) {
 		if (b->bm_on_pmem) {
 			void *src = b->bm_on_pmem;
@@ -936,6 +1411,14 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		opages = b->bm_pages;
 		b->bm_pages = npages;
 	}
+
+	odflags = b->bm_disk_page_flags;
+	if (ndflags != odflags) {
+		if (odflags)
+			memcpy(ndflags, odflags, sizeof(unsigned long) * min(disk_pages, odisk_pages));
+		b->bm_disk_page_flags = ndflags;
+	}
+	b->bm_slot_pages = slot_pages;
 	b->bm_number_of_pages = want;
 	b->bm_bits  = bits;
 	b->bm_words = words;
@@ -958,7 +1441,15 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		}
 	}
 
-	if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
+	if (b->bm_flags & BM_CONTIGUOUS) {
+		if (slot_pages < oslot_pages) {
+			unsigned int bitmap_index;
+
+			for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+				bm_free_pages(opages + bitmap_index * oslot_pages + slot_pages,
+					      oslot_pages - slot_pages);
+		}
+	} else if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
 		/* implicit: (opages != NULL) && (opages != npages) */
 		bm_free_pages(opages + want, have - want);
 	}
@@ -966,7 +1457,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	spin_unlock_irq(&b->bm_lock);
 	if (opages != npages)
 		kvfree(opages);
-	if (!growing)
+	if (oweights != nweights)
+		kvfree(oweights);
+	if (odflags != ndflags)
+		kvfree(odflags);
+	if (!growing || recount)
 		bm_count_bits(device);
 	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
 
@@ -1077,39 +1572,92 @@ static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 	kfree(ctx);
 }
 
+/* With BM_CONTIGUOUS, bitmap IO goes through bounce pages in the on disk
+ * (interleaved) layout.  Gather the words of on disk page page_nr from the
+ * in core slots, or scatter them there. */
+static void bm_convert_disk_page(struct drbd_bitmap *bitmap, unsigned int page_nr,
+				 __le32 *disk, bool to_disk)
+{
+	const unsigned long words32_per_page = 1UL << (PAGE_SHIFT - 2);
+	unsigned long first = (unsigned long)page_nr << (PAGE_SHIFT - 2);
+	unsigned long words32_total = bitmap->bm_words * sizeof(unsigned long) / sizeof(u32);
+	unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned int bitmap_index;
+
+	for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++) {
+		unsigned long word = first + (bitmap_index + max_peers - first % max_peers) % max_peers;
+		unsigned int current_page_nr = 0;
+		__le32 *addr = NULL;
+
+		for (; word < first + words32_per_page; word += max_peers) {
+			unsigned long in_core;
+
+			if (word >= words32_total) {
+				if (to_disk)
+					disk[word - first] = 0;
+				continue;
+			}
+			in_core = bm_word32(bitmap, bitmap_index, (word / max_peers) << 5);
+			if (!addr || current_page_nr != word32_to_page(in_core)) {
+				if (addr)
+					bm_unmap(bitmap, addr);
+				current_page_nr = word32_to_page(in_core);
+				addr = bm_map(bitmap, current_page_nr);
+			}
+			if (to_disk)
+				disk[word - first] = addr[word32_in_page(in_core)];
+			else
+				addr[word32_in_page(in_core)] = disk[word - first];
+		}
+		if (addr)
+			bm_unmap(bitmap, addr);
+	}
+}
+
 /* bv_page may be a copy, or may be the original */
 static void drbd_bm_endio(struct bio *bio)
 {
 	struct drbd_bm_aio_ctx *ctx = bio->bi_private;
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	unsigned int idx = bm_page_to_idx(bio->bi_io_vec[0].bv_page);
-
 	blk_status_t status = bio->bi_status;
+	unsigned int i;
 
-	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
-	    !bm_test_page_unchanged(b->bm_pages[idx]))
-		drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
-
-	if (status) {
-		/* ctx error will hold the completed-last non-zero error code,
-		 * in case error codes differ. */
+	/* ctx error will hold the completed-last non-zero error code,
+	 * in case error codes differ. */
+	if (status)
 		ctx->error = blk_status_to_errno(status);
-		bm_set_page_io_err(b->bm_pages[idx]);
-		/* Not identical to on disk version of it.
-		 * Is BM_PAGE_IO_ERROR enough? */
-		if (drbd_ratelimit())
-			drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
-				 status, idx);
-	} else {
-		bm_clear_page_io_err(b->bm_pages[idx]);
-		dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
-	}
 
-	bm_page_unlock_io(device, idx);
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		struct page *page = bio->bi_io_vec[i].bv_page;
+		unsigned int idx = bm_page_to_idx(page);
+
+		if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
+		    !bm_test_page_unchanged(b, idx))
+			drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
+
+		if (status) {
+			bm_set_page_io_err(b, idx);
+			/* Not identical to on disk version of it.
+			 * Is BM_PAGE_IO_ERROR enough? */
+			if (drbd_ratelimit())
+				drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
+					 status, idx);
+		} else {
+			bm_clear_page_io_err(b, idx);
+			dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
+			if ((ctx->flags & BM_AIO_READ) && (b->bm_flags & BM_CONTIGUOUS)) {
+				void *disk = kmap_atomic(page);
+				bm_convert_disk_page(b, idx, disk, false);
+				kunmap_atomic(disk);
+			}
+		}
 
-	if (ctx->flags & BM_AIO_COPY_PAGES)
-		mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
+		bm_page_unlock_io(device, idx);
+
+		if ((ctx->flags & BM_AIO_COPY_PAGES) || (b->bm_flags & BM_CONTIGUOUS))
+			mempool_free(page, &drbd_md_io_page_pool);
+	}
 
 	bio_put(bio);
 
@@ -1120,43 +1668,71 @@ static void drbd_bm_endio(struct bio *bio)
 	}
 }
 
-static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_hold(local)
+/* Submit one bio for up to nr_pages adjacent on disk bitmap pages, starting
+ * at page_nr.  Returns the number of pages it covers, which may be less than
+ * requested: Only the first bounce page is allocated with a blocking
+ * mempool_alloc(), so concurrent batches cannot starve each other of the
+ * shared page pool.  Pages are locked in ascending order. */
+static unsigned int bm_page_io_async(struct drbd_bm_aio_ctx *ctx, unsigned int page_nr,
+				     unsigned int nr_pages) __must_hold(local)
 {
-	struct bio *bio = bio_alloc_drbd(GFP_NOIO);
+	struct bio *bio = bio_alloc_drbd(GFP_NOIO, nr_pages);
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page;
-	unsigned int len;
+	bool bounce = (ctx->flags & BM_AIO_COPY_PAGES) || (b->bm_flags & BM_CONTIGUOUS);
+	sector_t last_sector = drbd_md_last_sector(device->ldev);
+	unsigned int i, len, size = 0;
 	unsigned int op = (ctx->flags & BM_AIO_READ) ? REQ_OP_READ : REQ_OP_WRITE;
 
 	sector_t on_disk_sector =
 		device->ldev->md.md_offset + device->ldev->md.bm_offset;
 	on_disk_sector += ((sector_t)page_nr) << (PAGE_SHIFT-9);
 
-	/* this might happen with very small
-	 * flexible external meta data device,
-	 * or with PAGE_SIZE > 4k */
-	len = min_t(unsigned int, PAGE_SIZE,
-		(drbd_md_last_sector(device->ldev) - on_disk_sector + 1)<<9);
-
-	/* serialize IO on this page */
-	bm_page_lock_io(device, page_nr);
-	/* before memcpy and submit,
-	 * so it can be redirtied any time */
-	bm_set_page_unchanged(b->bm_pages[page_nr]);
-
-	if (ctx->flags & BM_AIO_COPY_PAGES) {
-		page = mempool_alloc(&drbd_md_io_page_pool,
-				GFP_NOIO | __GFP_HIGHMEM);
-		copy_highpage(page, b->bm_pages[page_nr]);
-		bm_store_page_idx(page, page_nr);
-	} else
-		page = b->bm_pages[page_nr];
+	for (i = 0; i < nr_pages; i++) {
+		struct page *page = NULL;
+
+		/* this might happen with very small
+		 * flexible external meta data device,
+		 * or with PAGE_SIZE > 4k */
+		len = min_t(unsigned int, PAGE_SIZE,
+			(last_sector - (on_disk_sector + (size >> 9)) + 1)<<9);
+
+		if (bounce) {
+			page = mempool_alloc(&drbd_md_io_page_pool, __GFP_HIGHMEM |
+					     (i ? GFP_NOWAIT : GFP_NOIO));
+			if (!page)
+				break;
+		}
+
+		/* serialize IO on this page */
+		bm_page_lock_io(device, page_nr + i);
+		/* before memcpy and submit,
+		 * so it can be redirtied any time */
+		bm_set_page_unchanged(b, page_nr + i);
+
+		if (b->bm_flags & BM_CONTIGUOUS) {
+			if (op == REQ_OP_WRITE) {
+				void *disk = kmap_atomic(page);
+				bm_convert_disk_page(b, page_nr + i, disk, true);
+				kunmap_atomic(disk);
+			}
+			bm_store_page_idx(page, page_nr + i);
+		} else if (ctx->flags & BM_AIO_COPY_PAGES) {
+			copy_highpage(page, b->bm_pages[page_nr + i]);
+			bm_store_page_idx(page, page_nr + i);
+		} else
+			page = b->bm_pages[page_nr + i];
+		/* we allocated the bio with room for nr_pages,
+		 * so this will succeed. */
+		bio_add_page(bio, page, len, 0);
+		size += len;
+		if (len < PAGE_SIZE) {
+			i++;
+			break;
+		}
+	}
 	bio_set_dev(bio, device->ldev->md_bdev);
 	bio->bi_iter.bi_sector = on_disk_sector;
-	/* bio_add_page of a single page to an empty bio will always succeed,
-	 * according to api.  Do we want to assert that? */
-	bio_add_page(bio, page, len, 0);
 	bio->bi_private = ctx;
 	bio->bi_end_io = drbd_bm_endio;
 	bio->bi_opf = op;
@@ -1168,8 +1744,44 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 		submit_bio(bio);
 		/* this should not count as user activity and cause the
 		 * resync to throttle -- see drbd_rs_should_slow_down(). */
-		atomic_add(len >> 9, &device->rs_sect_ev);
+		atomic_add(size >> 9, &device->rs_sect_ev);
 	}
+	return i;
+}
+
+/* Upper limit of pages per bitmap bio; small enough that a single bio
+ * never needs the better part of drbd_md_io_page_pool. */
+#define BM_IO_MAX_PAGES 32
+
+/* a run of adjacent on disk bitmap pages to be submitted as one bio */
+struct bm_io_run {
+	unsigned int start;
+	unsigned int len;
+	unsigned int max;
+	unsigned int bios;
+};
+
+static void bm_page_io_flush(struct drbd_bm_aio_ctx *ctx, struct bm_io_run *run) __must_hold(local)
+{
+	while (run->len) {
+		unsigned int n;
+
+		atomic_inc(&ctx->in_flight);
+		n = bm_page_io_async(ctx, run->start, run->len);
+		run->start += n;
+		run->len -= n;
+		run->bios++;
+	}
+}
+
+static void bm_page_io_add(struct drbd_bm_aio_ctx *ctx, struct bm_io_run *run,
+			   unsigned int page_nr) __must_hold(local)
+{
+	if (run->len && (page_nr != run->start + run->len || run->len >= run->max))
+		bm_page_io_flush(ctx, run);
+	if (!run->len)
+		run->start = page_nr;
+	run->len++;
 }
 
 /**
@@ -1194,6 +1806,7 @@ static int bm_rw_range(struct drbd_device *device,
 {
 	struct drbd_bm_aio_ctx *ctx;
 	struct drbd_bitmap *b = device->bitmap;
+	struct bm_io_run run = { };
 	unsigned int i, count = 0;
 	unsigned long now;
 	int err = 0;
@@ -1243,8 +1856,12 @@ static int bm_rw_range(struct drbd_device *device,
 	if (0 == (ctx->flags & ~BM_AIO_READ))
 		WARN_ON(!(b->bm_flags & BM_LOCK_ALL));
 
-	if (end_page >= b->bm_number_of_pages)
-		end_page = b->bm_number_of_pages -1;
+	if (end_page >= bm_number_of_disk_pages(b))
+		end_page = bm_number_of_disk_pages(b) - 1;
+
+	/* recalculated by bm_count_bits() once the read completed */
+	if (flags & BM_AIO_READ)
+		b->bm_flags &= ~BM_PAGE_WEIGHTS_VALID;
 
 	spin_lock_irq(&device->pending_bmio_lock);
 	list_add_tail(&ctx->list, &device->pending_bitmap_io);
@@ -1252,12 +1869,15 @@ static int bm_rw_range(struct drbd_device *device,
 
 	now = jiffies;
 
-	/* let the layers below us try to merge these bios... */
+	/* adjacent pages are submitted as one bio, up to what the
+	 * meta data device takes in one request */
+	run.max = clamp_t(unsigned int,
+			  queue_max_sectors(bdev_get_queue(device->ldev->md_bdev)) >> (PAGE_SHIFT - 9),
+			  1, BM_IO_MAX_PAGES);
 
 	if (flags & BM_AIO_READ) {
 		for (i = start_page; i <= end_page; i++) {
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_page_io_add(ctx, &run, i);
 			++count;
 			cond_resched();
 		}
@@ -1269,14 +1889,12 @@ static int bm_rw_range(struct drbd_device *device,
 			if (i > end_page)
 				continue;
 			/* Several AL-extents may point to the same page. */
-			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT,
-			    &page_private(b->bm_pages[i])))
+			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT, bm_page_flags(b, i)))
 				continue;
 			/* Has it even changed? */
-			if (bm_test_page_unchanged(b->bm_pages[i]))
+			if (bm_test_page_unchanged(b, i))
 				continue;
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_page_io_add(ctx, &run, i);
 			++count;
 		}
 	} else {
@@ -1284,23 +1902,31 @@ static int bm_rw_range(struct drbd_device *device,
 			/* ignore completely unchanged pages,
 			 * unless specifically requested to write ALL pages */
 			if (!(flags & BM_AIO_WRITE_ALL_PAGES) &&
-			    bm_test_page_unchanged(b->bm_pages[i])) {
+			    bm_test_page_unchanged(b, i)) {
 				dynamic_drbd_dbg(device, "skipped bm write for idx %u\n", i);
 				continue;
 			}
 			/* during lazy writeout,
 			 * ignore those pages not marked for lazy writeout. */
 			if ((flags & BM_AIO_WRITE_LAZY) &&
-			    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
+			    !bm_test_page_lazy_writeout(b, i)) {
 				dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", i);
 				continue;
 			}
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_page_io_add(ctx, &run, i);
 			++count;
 			cond_resched();
 		}
 	}
+	bm_page_io_flush(ctx, &run);
+
+	if (!(flags & BM_AIO_READ) && count) {
+		spin_lock_irq(&device->pending_bmio_lock);
+		device->bm_writeouts++;
+		device->bm_writeout_pages += count;
+		device->bm_writeout_bios += run.bios;
+		spin_unlock_irq(&device->pending_bmio_lock);
+	}
 
 	/*
 	 * We initialize ctx->in_flight to one to make sure drbd_bm_endio
@@ -1319,9 +1945,9 @@ static int bm_rw_range(struct drbd_device *device,
 	if (flags == 0 && count) {
 		unsigned int ms = jiffies_to_msecs(jiffies - now);
 		if (ms > 5) {
-			drbd_info(device, "bitmap %s of %u pages took %u ms\n",
+			drbd_info(device, "bitmap %s of %u pages in %u bios took %u ms\n",
 				 (flags & BM_AIO_READ) ? "READ" : "WRITE",
-				 count, ms);
+				 count, run.bios, ms);
 		}
 	}
 
@@ -1363,9 +1989,8 @@ int drbd_bm_read(struct drbd_device *device,
 static void push_al_bitmap_hint(struct drbd_device *device, unsigned int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page = b->bm_pages[page_nr];
 	BUG_ON(b->n_bitmap_hints >= ARRAY_SIZE(b->al_bitmap_hints));
-	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
+	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, bm_page_flags(b, page_nr)))
 		b->al_bitmap_hints[b->n_bitmap_hints++] = page_nr;
 }
 
@@ -1543,11 +2168,11 @@ _drbd_bm_set_many_bits(struct drbd_device *device, int bitmap_index, unsigned lo
 /* set all bits in the bitmap */
 void drbd_bm_set_all(struct drbd_device *device)
 {
-       struct drbd_bitmap *bitmap = device->bitmap;
-       unsigned int bitmap_index;
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned int bitmap_index;
 
-       for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
-	       __bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_SET);
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
+		__bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_SET);
 }
 
 /* clear all bits in the bitmap */
@@ -1598,20 +2223,29 @@ int drbd_bm_count_bits(struct drbd_device *device, unsigned int bitmap_index, un
 void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned long word_nr, from_word_nr, to_word_nr, words32_total;
+	unsigned long lw, from_word_nr, to_word_nr, words32_total;
 	unsigned int from_page_nr, to_page_nr, current_page_nr;
 	u32 data_word, *addr;
 
-	words32_total = bitmap->bm_words * sizeof(unsigned long) / sizeof(u32);
+	/* 32 bit words per bitmap slot */
+	words32_total = bitmap->bm_words * sizeof(unsigned long) / sizeof(u32) / bitmap->bm_max_peers;
 	spin_lock_irq(&bitmap->bm_lock);
 
 	bitmap->bm_set[to_index] = 0;
+	if (bitmap->bm_page_weight) {
+		if (bitmap->bm_flags & BM_CONTIGUOUS)
+			memset(bm_page_weight(bitmap, to_index, to_index * bitmap->bm_slot_pages), 0,
+			       sizeof(unsigned int) * bitmap->bm_slot_pages);
+		else
+			memset(bm_page_weight(bitmap, to_index, 0), 0,
+			       sizeof(unsigned int) * bitmap->bm_number_of_pages);
+	}
 	current_page_nr = 0;
 	addr = bm_map(bitmap, current_page_nr);
-	for (word_nr = 0; word_nr < words32_total; word_nr += bitmap->bm_max_peers) {
-		from_word_nr = word_nr + from_index;
+	for (lw = 0; lw < words32_total; lw++) {
+		from_word_nr = bm_word32(bitmap, from_index, lw << 5);
 		from_page_nr = word32_to_page(from_word_nr);
-		to_word_nr = word_nr + to_index;
+		to_word_nr = bm_word32(bitmap, to_index, lw << 5);
 		to_page_nr = word32_to_page(to_word_nr);
 
 		if (current_page_nr != from_page_nr) {
@@ -1626,8 +2260,7 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 		}
 		data_word = addr[word32_in_page(from_word_nr)];
 
-		if (word_nr == words32_total - bitmap->bm_max_peers) {
-			unsigned long lw = word_nr / bitmap->bm_max_peers;
+		if (lw == words32_total - 1) {
 			if (bitmap->bm_bits < (lw + 1) * 32)
 			    data_word &= cpu_to_le32((1 << (bitmap->bm_bits - lw * 32)) - 1);
 		}
@@ -1639,9 +2272,12 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 		}
 
 		if (addr[word32_in_page(to_word_nr)] != data_word)
-			bm_set_page_need_writeout(bitmap, current_page_nr);
+			bm_set_pages_writeout(bitmap, to_index, current_page_nr,
+					      lw << 5, (lw << 5) | 31, false);
 		addr[word32_in_page(to_word_nr)] = data_word;
 		bitmap->bm_set[to_index] += hweight32(data_word);
+		if (bitmap->bm_page_weight)
+			*bm_page_weight(bitmap, to_index, current_page_nr) += hweight32(data_word);
 	}
 	bm_unmap(bitmap, addr);
 
@@ -70,6 +70,7 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 	seq_print_rq_state_bit(m, s & RQ_IN_ACT_LOG, &sep, "in-AL");
 	seq_print_rq_state_bit(m, s & RQ_POSTPONED, &sep, "postponed");
 	seq_print_rq_state_bit(m, s & RQ_COMPLETION_SUSP, &sep, "suspended");
+	seq_print_rq_state_bit(m, s & RQ_AL_FAILED, &sep, "al-failed");
 	sep = ' ';
 	seq_print_rq_state_bit(m, s & RQ_LOCAL_PENDING, &sep, "pending");
 	seq_print_rq_state_bit(m, s & RQ_LOCAL_COMPLETED, &sep, "completed");
@@ -799,6 +800,8 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 		seq_printf(m, "  corked: %d\n", test_bit(CORKED + i, &connection->flags));
 		seq_printf(m, "  unsent: %ld bytes\n", (long)(sbuf->pos - sbuf->unsent));
 		seq_printf(m, "  allocated: %d bytes\n", sbuf->allocated_size);
+		seq_printf(m, "  buffers: %u x %u bytes\n", DRBD_SEND_BUFFER_RING, sbuf->size);
+		seq_printf(m, "  waited for buffer: %u\n", sbuf->waited);
 	}
 
 	seq_printf(m, "\ntransport_type: %s\n", transport->class->name);
@@ -1036,6 +1039,37 @@ static int device_openers_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static void seq_print_read_lat(struct seq_file *m, const char *name, struct drbd_read_lat *rl,
+			       int pending)
+{
+	unsigned long last_sample = READ_ONCE(rl->last_sample);
+
+	seq_printf(m, "%-8s %10lu %8d %8u\n", name, READ_ONCE(rl->ewma_ns) / NSEC_PER_USEC,
+		   pending, last_sample ? jiffies_to_msecs(jiffies - last_sample) : 0);
+}
+
+/* the estimates drbd_latency_read_balancing works with */
+static int device_read_balancing_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_peer_device *peer_device;
+	char name[16];
+
+	seq_printf(m, "policy: %s\n", drbd_latency_read_balancing ? "latency" : "disk-options");
+	seq_puts(m, "target   ewma(usec)  pending  age(ms)\n");
+	seq_print_read_lat(m, "local", &device->read_lat, atomic_read(&device->local_cnt));
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		snprintf(name, sizeof(name), "node%d", peer_device->node_id);
+		seq_print_read_lat(m, name, &peer_device->read_lat,
+				   atomic_read(&peer_device->ap_pending_cnt) +
+				   atomic_read(&peer_device->rs_pending_cnt));
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
 static int device_md_io_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -1048,6 +1082,23 @@ static int device_md_io_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_bitmap_io_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	unsigned long writeouts, pages, bios;
+
+	spin_lock_irq(&device->pending_bmio_lock);
+	writeouts = device->bm_writeouts;
+	pages = device->bm_writeout_pages;
+	bios = device->bm_writeout_bios;
+	spin_unlock_irq(&device->pending_bmio_lock);
+
+	seq_printf(m, "writeouts: %lu\npages: %lu\nbios: %lu\n", writeouts, pages, bios);
+	if (writeouts)
+		seq_printf(m, "bios per writeout: %lu\n", bios / writeouts);
+	return 0;
+}
+
 static int device_data_gen_id_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -1190,6 +1241,136 @@ static ssize_t device_req_timing_write(struct file *file, const char __user *ubu
 	*ppos += cnt;
 	return cnt;
 }
+
+static void lat_hist_sum(struct drbd_lat_hist *sum, struct drbd_lat_hist __percpu *hist)
+{
+	int cpu, b;
+
+	memset(sum, 0, sizeof(*sum));
+	if (!hist)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct drbd_lat_hist *h = per_cpu_ptr(hist, cpu);
+
+		for (b = 0; b < DRBD_LAT_BUCKETS; b++)
+			sum->bucket[b] += READ_ONCE(h->bucket[b]);
+	}
+}
+
+static void lat_hist_reset(struct drbd_lat_hist __percpu *hist)
+{
+	int cpu;
+
+	/* racing increments may get lost, that is fine for statistics */
+	if (!hist)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hist, cpu), 0, sizeof(struct drbd_lat_hist));
+}
+
+/* upper bound of the bucket containing the given quantile, in microseconds */
+static unsigned long lat_hist_quantile(struct drbd_lat_hist *h, unsigned int per_mille)
+{
+	unsigned long total = 0, sum = 0;
+	int b;
+
+	for (b = 0; b < DRBD_LAT_BUCKETS; b++)
+		total += h->bucket[b];
+	if (!total)
+		return 0;
+	for (b = 0; b < DRBD_LAT_BUCKETS; b++) {
+		sum += h->bucket[b];
+		if (sum * 1000 >= total * per_mille)
+			break;
+	}
+	return 1UL << min(b, DRBD_LAT_BUCKETS - 1);
+}
+
+static int device_req_latency_show(struct seq_file *m, void *ignored)
+{
+	static const char * const phase_names[DRBD_LAT_PHASES] = {
+		[DRBD_LAT_AL_WAIT] = "al_wait",
+		[DRBD_LAT_LOCAL] = "local",
+		[DRBD_LAT_MASTER] = "master",
+	};
+	static const unsigned int quantiles[] = { 500, 900, 990, 999 };
+	struct drbd_device *device = m->private;
+	struct drbd_peer_device *peer_device;
+	struct drbd_lat_hist *h;
+	int n = DRBD_LAT_PHASES, i, b, q;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	h = kmalloc_array(DRBD_LAT_PHASES + DRBD_PEERS_MAX, sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return -ENOMEM;
+
+	for (i = 0; i < DRBD_LAT_PHASES; i++)
+		lat_hist_sum(&h[i], device->lat_hist ? device->lat_hist + i : NULL);
+
+	seq_puts(m, "write request latencies, log2 buckets in microseconds;\n"
+		    "peer columns are send to ack; write an 'r' to reset all to 0\n\n");
+	seq_printf(m, "%8s", "< us");
+	for (i = 0; i < DRBD_LAT_PHASES; i++)
+		seq_printf(m, " %12s", phase_names[i]);
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		if (n == DRBD_LAT_PHASES + DRBD_PEERS_MAX)
+			break;
+		lat_hist_sum(&h[n++], peer_device->lat_hist_ack);
+		seq_printf(m, " %12.12s",
+			   rcu_dereference(peer_device->connection->transport.net_conf)->name);
+	}
+	rcu_read_unlock();
+	seq_puts(m, "\n");
+
+	for (b = 0; b < DRBD_LAT_BUCKETS; b++) {
+		if (b < DRBD_LAT_BUCKETS - 1)
+			seq_printf(m, "%8lu", 1UL << b);
+		else
+			seq_printf(m, "%8s", "more");
+		for (i = 0; i < n; i++)
+			seq_printf(m, " %12lu", h[i].bucket[b]);
+		seq_puts(m, "\n");
+	}
+
+	seq_puts(m, "\n");
+	for (q = 0; q < ARRAY_SIZE(quantiles); q++) {
+		seq_printf(m, "p%-7u", quantiles[q] / (quantiles[q] % 10 ? 1 : 10));
+		for (i = 0; i < n; i++)
+			seq_printf(m, " %12lu", lat_hist_quantile(&h[i], quantiles[q]));
+		seq_puts(m, "\n");
+	}
+
+	kfree(h);
+	return 0;
+}
+
+static ssize_t device_req_latency_write(struct file *file, const char __user *ubuf,
+					size_t cnt, loff_t *ppos)
+{
+	struct drbd_device *device = file_inode(file)->i_private;
+	char buffer;
+
+	if (copy_from_user(&buffer, ubuf, 1))
+		return -EFAULT;
+
+	if (buffer == 'r' || buffer == 'R') {
+		struct drbd_peer_device *peer_device;
+		int i;
+
+		for (i = 0; i < DRBD_LAT_PHASES && device->lat_hist; i++)
+			lat_hist_reset(device->lat_hist + i);
+		rcu_read_lock();
+		for_each_peer_device_rcu(peer_device, device)
+			lat_hist_reset(peer_device->lat_hist_ack);
+		rcu_read_unlock();
+	}
+
+	*ppos += cnt;
+	return cnt;
+}
 #endif
 
 static int device_attr_release(struct inode *inode, struct file *file)
@@ -1224,8 +1405,11 @@ drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
 drbd_debugfs_device_attr(openers)
 drbd_debugfs_device_attr(md_io)
+drbd_debugfs_device_attr(bitmap_io)
+drbd_debugfs_device_attr(read_balancing)
 #ifdef CONFIG_DRBD_TIMING_STATS
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
+__drbd_debugfs_device_attr(req_latency, device_req_latency_write)
 #endif
 
 void drbd_debugfs_device_add(struct drbd_device *device)
@@ -1263,8 +1447,11 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(ed_gen_id);
 	vol_dcf(openers);
 	vol_dcf(md_io);
+	vol_dcf(bitmap_io);
+	vol_dcf(read_balancing);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_dcf(device->debugfs_vol, device, req_timing, 0600);
+	drbd_dcf(device->debugfs_vol, device, req_latency, 0600);
 #endif
 
 	/* Caller holds conf_update */
@@ -1291,8 +1478,11 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_openers);
 	drbd_debugfs_remove(&device->debugfs_vol_md_io);
+	drbd_debugfs_remove(&device->debugfs_vol_bitmap_io);
+	drbd_debugfs_remove(&device->debugfs_vol_read_balancing);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
+	drbd_debugfs_remove(&device->debugfs_vol_req_latency);
 #endif
 	drbd_debugfs_remove(&device->debugfs_vol);
 }
@@ -23,6 +23,7 @@
 #include <linux/sched/signal.h>
 #include <linux/bitops.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
 #include <linux/ratelimit.h>
 #include <linux/mutex.h>
 #include <linux/major.h>
@@ -60,6 +61,13 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern bool drbd_percpu_submit;
+extern bool drbd_peer_write_offload;
+extern bool drbd_contiguous_bitmap;
+extern unsigned int drbd_al_pipeline_depth;
+extern unsigned int drbd_al_transaction_blocks;
+extern bool drbd_latency_read_balancing;
+extern unsigned int drbd_diskless_read_stripe_kb;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -158,6 +166,8 @@ struct bm_xfer_ctx {
 	/* statistics; index: (h->command == P_BITMAP) */
 	unsigned packets[2];
 	unsigned bytes[2];
+	/* time spent en- or decoding */
+	u64 code_ns;
 };
 
 extern void INFO_bm_xfer_stats(struct drbd_peer_device *, const char *, struct bm_xfer_ctx *);
@@ -317,7 +327,6 @@ struct drbd_request {
 
 	/* for request_timer_fn() */
 	unsigned long pre_submit_jif;
-	unsigned long pre_send_jif[DRBD_PEERS_MAX];
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	/* for DRBD internal statistics */
@@ -328,12 +337,18 @@ struct drbd_request {
 
 	/* local disk */
 	ktime_t pre_submit_kt;
+	ktime_t local_done_kt;
 
 	/* per connection */
 	ktime_t pre_send_kt[DRBD_PEERS_MAX];
 	ktime_t acked_kt[DRBD_PEERS_MAX];
 	ktime_t net_done_kt[DRBD_PEERS_MAX];
+
+	/* application visible */
+	ktime_t master_done_kt;
 #endif
+	/* READ dispatched, if drbd_latency_read_balancing */
+	ktime_t rb_start_kt;
 	/* Possibly even more detail to track each phase:
 	 *  master_completion_kt
 	 *      how long did it take to complete the master bio
@@ -387,6 +402,12 @@ struct drbd_request {
 
 	/* for reclaim from transfer log */
 	struct rcu_head rcu;
+
+	/* Everything from here on is not cleared by drbd_req_new().
+	 * Only put fields here that are written before they are read. */
+
+	/* for request_timer_fn(); set by the sender before RQ_NET_SENT */
+	unsigned long pre_send_jif[DRBD_PEERS_MAX];
 };
 
 /* Used to multicast peer acks. */
@@ -446,6 +467,8 @@ struct drbd_peer_request {
 				struct digest_info *digest;
 			};
 			u64 dagtag_sector;
+			/* EE_VERIFY_DIGEST: received, and room for calculated digest */
+			void *int_dig;
 
 		};
 		struct { /* reused object to queue send OOS to other nodes */
@@ -527,6 +550,13 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* The data integrity digest is checked just before submit, in
+	 * drbd_submit_peer_request() */
+	__EE_VERIFY_DIGEST,
+
+	/* P_RECV_ACK is held back until the digest was verified */
+	__EE_SEND_RECEIVE_ACK,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -545,6 +575,8 @@ enum {
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_VERIFY_DIGEST	(1<<__EE_VERIFY_DIGEST)
+#define EE_SEND_RECEIVE_ACK	(1<<__EE_SEND_RECEIVE_ACK)
 
 /* flag bits per device */
 enum device_flag {
@@ -627,6 +659,11 @@ enum peer_device_flag {
 #define AL_UPDATES_PER_TRANSACTION	 64	// arbitrary
 #define AL_CONTEXT_PER_TRANSACTION	919	// (4096 - 36 - 6*64)/4
 
+/* With the al_transaction_blocks module parameter, one commit of the
+ * activity log may write up to this many consecutive transactions in one go,
+ * each one 4k block with its own updates and context. */
+#define AL_TRANSACTION_BLOCKS_MAX	  8
+
 /* definition of bits in bm_flags to be used in drbd_bm_lock
  * and drbd_bitmap_io and friends. */
 enum bm_flag {
@@ -649,6 +686,8 @@ enum bm_flag {
 
 	BM_LOCK_SINGLE_SLOT = 0x10,
 	BM_ON_DAX_PMEM = 0x10000,
+	BM_PAGE_WEIGHTS_VALID = 0x20000, /* bm_page_weight may be used to skip pages */
+	BM_CONTIGUOUS = 0x40000, /* in core, each bitmap slot has its own pages */
 };
 
 struct drbd_bitmap {
@@ -659,9 +698,18 @@ struct drbd_bitmap {
 	spinlock_t bm_lock;
 
 	unsigned long bm_set[DRBD_PEERS_MAX]; /* number of bits set */
+	/* number of bits set per bitmap slot and bitmap page,
+	 * indexed by bitmap_index * bm_number_of_pages + page */
+	unsigned int *bm_page_weight;
 	unsigned long bm_bits;  /* bits per peer */
 	size_t   bm_words; /* platform specitif word size; not 32bit!! */
 	size_t   bm_number_of_pages;
+	/* With BM_CONTIGUOUS, the in core pages of bitmap slot n are
+	 * bm_pages[n * bm_slot_pages ...], and the on disk (interleaved)
+	 * layout is only established during bitmap IO.  The per page
+	 * flags then refer to on disk pages and live in bm_disk_page_flags. */
+	size_t   bm_slot_pages;
+	unsigned long *bm_disk_page_flags;
 	sector_t bm_dev_capacity;
 	struct mutex bm_change; /* serializes resize operations */
 
@@ -679,7 +727,7 @@ struct drbd_bitmap {
 	 * AL-extent may be associated with one or two bitmap pages.
 	 */
 	unsigned int n_bitmap_hints;
-	unsigned int al_bitmap_hints[2*AL_UPDATES_PER_TRANSACTION];
+	unsigned int al_bitmap_hints[2*AL_UPDATES_PER_TRANSACTION*AL_TRANSACTION_BLOCKS_MAX];
 
 	/* debugging aid, in case we are still racy somewhere */
 	char          *bm_why;
@@ -740,6 +788,32 @@ struct drbd_backing_dev {
 #endif
 };
 
+#ifdef CONFIG_DRBD_TIMING_STATS
+/* log2 histogram of request phase latencies, kept per CPU.
+ * Bucket i counts latencies below 2^i microseconds (and not below 2^(i-1)),
+ * the last bucket everything from about 8 seconds on. */
+#define DRBD_LAT_BUCKETS 24
+
+struct drbd_lat_hist {
+	unsigned long bucket[DRBD_LAT_BUCKETS];
+};
+
+enum drbd_lat_phase {
+	DRBD_LAT_AL_WAIT,	/* start_kt .. in_actlog_kt */
+	DRBD_LAT_LOCAL,		/* pre_submit_kt .. local_done_kt */
+	DRBD_LAT_MASTER,	/* start_kt .. master_done_kt */
+	DRBD_LAT_PHASES
+};
+#endif
+
+/* Estimated service time of a read from the local disk or from one peer,
+ * for drbd_latency_read_balancing.  Updated without locking, losing an
+ * occasional sample to a concurrent update does not matter. */
+struct drbd_read_lat {
+	unsigned long ewma_ns;		/* moving average, weight 1/8 */
+	unsigned long last_sample;	/* jiffies */
+};
+
 struct drbd_md_io {
 	struct page *page;
 	unsigned long start_jif;	/* last call to drbd_md_get_buffer */
@@ -750,6 +824,28 @@ struct drbd_md_io {
 	int error;
 };
 
+/* An activity log transaction that has been submitted asynchronously.
+ * Lives on device->al_transactions, in tr_number order, until it is
+ * committed to the lru cache by drbd_al_commit_work(). */
+struct drbd_al_transaction {
+	struct list_head list;
+	struct drbd_device *device;
+	/* one on disk 4k block per AL_UPDATES_PER_TRANSACTION changes */
+	struct page *pages[AL_TRANSACTION_BLOCKS_MAX];
+	unsigned int n_blocks;
+	unsigned int pending_bios;	/* protected by al_lock */
+	struct list_head changes;	/* lc_take_pending() */
+	unsigned int n_changes;
+	unsigned int tr_number;		/* of the first block */
+	/* parked until this transaction is on stable storage */
+	struct list_head requests;
+	struct list_head peer_requests;
+	struct completion *done_sync;
+	int *error_sync;		/* tells the waiter on done_sync about error */
+	bool done;
+	int error;
+};
+
 struct bm_io_work {
 	struct drbd_work w;
 	struct drbd_device *device;
@@ -856,7 +952,17 @@ struct drbd_thread_timing_details
 };
 #define DRBD_THREAD_DETAILS_HIST	16
 
+/* Each stream packs its commands into a small ring of (compound) pages.
+ * A full buffer is flushed with a single send_page() call. While the network
+ * stack still holds a reference on that buffer, we continue in the next one. */
+#define DRBD_SEND_BUFFER_ORDER	3
+#define DRBD_SEND_BUFFER_RING	4
+
 struct drbd_send_buffer {
+	struct page *ring[DRBD_SEND_BUFFER_RING];
+	unsigned int ring_idx;
+	unsigned int size; /* PAGE_SIZE << order of each buffer in the ring */
+	unsigned int waited; /* how often all buffers were still in use */
 	struct page *page;  /* current buffer page for sending data */
 	char *unsent;  /* start of unsent area != pos if corked... */
 	char *pos; /* position within that page */
@@ -891,17 +997,26 @@ struct drbd_resource {
 	struct mutex adm_mutex;		/* mutex to serialize administrative requests */
 	struct mutex open_release;	/* serialize open/release */
 	rwlock_t state_rwlock;          /* serialize state changes */
-	u64 dagtag_sector;		/* Protected by tl_update_lock.
-					 * See also dagtag_sector in
-					 * &drbd_request */
 	unsigned long flags;
 
-	/* Protects updates to the transfer log and related counters. */
-	spinlock_t tl_update_lock;
+	/* Protects updates to the transfer log and related counters.
+	 * Every request submission writes these, readers walk the transfer
+	 * log under RCU.  Keep them on cache lines of their own, so appending
+	 * does not bounce the lines holding flags and state_rwlock. */
+	spinlock_t tl_update_lock ____cacheline_aligned_in_smp;
 	struct list_head transfer_log;	/* all requests not yet fully processed */
 	struct drbd_request *tl_previous_write;
+	u64 dagtag_sector;		/* Protected by tl_update_lock.
+					 * See also dagtag_sector in
+					 * &drbd_request */
 
-	spinlock_t peer_ack_lock;
+	/* Protects the current transfer log (tle) fields.
+	 * Nests inside tl_update_lock on submission. */
+	spinlock_t current_tle_lock;
+	atomic_t current_tle_nr;	/* transfer log epoch number */
+	unsigned current_tle_writes;	/* writes seen within this tl epoch */
+
+	spinlock_t peer_ack_lock ____cacheline_aligned_in_smp;
 	struct list_head peer_ack_req_list;  /* requests to send peer acks for */
 	struct list_head peer_ack_list;  /* peer acks to send */
 	struct drbd_work peer_ack_work;
@@ -940,11 +1055,6 @@ struct drbd_resource {
 
 	enum write_ordering_e write_ordering;
 
-	/* Protects the current transfer log (tle) fields. */
-	spinlock_t current_tle_lock;
-	atomic_t current_tle_nr;	/* transfer log epoch number */
-	unsigned current_tle_writes;	/* writes seen within this tl epoch */
-
 	unsigned cached_min_aggreed_protocol_version;
 
 	cpumask_var_t cpu_mask;
@@ -1031,6 +1141,7 @@ struct drbd_connection {
 	u64 last_dagtag_sector;
 
 	atomic_t active_ee_cnt;
+	atomic_t digests_in_flight;	/* peer requests with EE_VERIFY_DIGEST */
 	spinlock_t peer_reqs_lock;
 	struct list_head peer_requests; /* All peer requests in the order we received them.. */
 	struct list_head active_ee; /* IO in progress (P_DATA gets written to disk) */
@@ -1261,14 +1372,18 @@ struct drbd_peer_device {
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
 	ktime_t net_done_kt;
+#ifdef CONFIG_DRBD_TIMING_STATS
+	struct drbd_lat_hist __percpu *lat_hist_ack; /* pre_send_kt .. acked_kt */
+#endif
+	struct drbd_read_lat read_lat;
 
 	struct {/* sender todo per peer_device */
 		bool was_ahead;
 	} todo;
 };
 
-struct submit_worker {
-	struct workqueue_struct *wq;
+struct submit_queue {
+	struct drbd_device *device;
 	struct work_struct worker;
 
 	spinlock_t lock;
@@ -1276,6 +1391,18 @@ struct submit_worker {
 	struct list_head peer_writes;
 };
 
+struct submit_worker {
+	struct workqueue_struct *wq;
+	/* runs drbd_al_commit_work() */
+	struct workqueue_struct *commit_wq;
+
+	/* with the percpu_submit module parameter set, each CPU queues to
+	 * its own submit_queue, and the workers share AL transactions.
+	 * Otherwise percpu is NULL, and everything goes through single. */
+	struct submit_queue __percpu *percpu;
+	struct submit_queue single;
+};
+
 struct opener {
 	struct list_head list;
 	char comm[TASK_COMM_LEN];
@@ -1294,6 +1421,11 @@ struct drbd_device {
 
 	spinlock_t pending_bmio_lock;
 	struct list_head pending_bitmap_io;
+	/* bitmap writeouts, and the pages and bios written by them;
+	 * protected by pending_bmio_lock */
+	unsigned long bm_writeouts;
+	unsigned long bm_writeout_pages;
+	unsigned long bm_writeout_bios;
 
 	struct opener openers;
 
@@ -1309,8 +1441,11 @@ struct drbd_device {
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_openers;
 	struct dentry *debugfs_vol_md_io;
+	struct dentry *debugfs_vol_bitmap_io;
+	struct dentry *debugfs_vol_read_balancing;
 #ifdef CONFIG_DRBD_TIMING_STATS
 	struct dentry *debugfs_vol_req_timing;
+	struct dentry *debugfs_vol_req_latency;
 #endif
 #endif
 
@@ -1342,6 +1477,7 @@ struct drbd_device {
 	unsigned int bm_writ_cnt;
 	atomic_t ap_bio_cnt[2];	 /* Requests we need to complete. [READ] and [WRITE] */
 	atomic_t local_cnt;	 /* Waiting for local completion */
+	atomic_t local_read_cnt; /* Reads submitted to the backing device */
 	atomic_t ap_actlog_cnt;  /* Requests waiting for activity log */
 	atomic_t wait_for_actlog; /* Peer requests waiting for activity log */
 	/* worst case extent count needed to satisfy both requests and peer requests
@@ -1375,6 +1511,11 @@ struct drbd_device {
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
 	unsigned int al_tr_number;
 	int al_tr_cycle;
+	/* asynchronous activity log transactions, see drbd_al_pipeline_depth;
+	 * protected by al_lock */
+	struct list_head al_transactions;
+	unsigned int al_transactions_in_flight;
+	struct work_struct al_commit_work;
 	wait_queue_head_t seq_wait;
 	u64 exposed_data_uuid; /* UUID of the exposed data */
 	u64 next_exposed_data_uuid;
@@ -1391,6 +1532,7 @@ struct drbd_device {
 	 * are deferred to this single-threaded work queue */
 	struct submit_worker submit;
 	u64 read_nodes; /* used for balancing read requests among peers */
+	struct drbd_read_lat read_lat; /* of the local disk */
 	bool have_quorum[2];	/* no quorum -> suspend IO or error IO */
 	bool cached_state_unstable; /* updates with each state change */
 	bool cached_err_io; /* complete all IOs with error */
@@ -1407,6 +1549,8 @@ struct drbd_device {
 	ktime_t al_before_bm_write_hinted_kt; /* sum over all al_writ_cnt */
 	ktime_t al_mid_kt;
 	ktime_t al_after_sync_page_kt;
+
+	struct drbd_lat_hist __percpu *lat_hist; /* [DRBD_LAT_PHASES] */
 #endif
 
 	struct rcu_head rcu;
@@ -1759,6 +1903,7 @@ static inline int interval_to_al_extents(struct drbd_interval *i)
 	return 1 + last - first; /* worst case: all touched extends are cold. */
 }
 
+extern struct workqueue_struct *drbd_bm_wq;
 extern struct drbd_bitmap *drbd_bm_alloc(void);
 extern int  drbd_bm_resize(struct drbd_device *device, sector_t sectors, bool set_new_bits);
 void drbd_bm_free(struct drbd_bitmap *bitmap);
@@ -1813,6 +1958,7 @@ extern struct kmem_cache *drbd_ee_cache;	/* peer requests */
 extern struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 extern mempool_t drbd_request_mempool;
+extern void drbd_req_cache_drain(void);
 extern mempool_t drbd_ee_mempool;
 
 /* drbd's page pool, used to buffer data received from the peer,
@@ -1832,6 +1978,8 @@ extern struct page *drbd_pp_pool;
 extern spinlock_t   drbd_pp_lock;
 extern int	    drbd_pp_vacant;
 extern wait_queue_head_t drbd_pp_wait;
+extern void drbd_pp_mag_drain_all(void);
+extern unsigned int drbd_alloc_page_run(struct page **head, unsigned int max, gfp_t gfp_mask);
 
 /* We also need a standard (emergency-reserve backed) page pool
  * for meta data IO (activity log, bitmap).
@@ -1845,11 +1993,14 @@ extern mempool_t drbd_md_io_page_pool;
  * when we need it for housekeeping purposes */
 extern struct bio_set drbd_md_io_bio_set;
 /* to allocate from that set */
-extern struct bio *bio_alloc_drbd(gfp_t gfp_mask);
+extern struct bio *bio_alloc_drbd(gfp_t gfp_mask, unsigned int nr_iovecs);
 
 /* And a bio_set for cloning */
 extern struct bio_set drbd_io_bio_set;
 
+/* and one for splitting reads for striping across peers */
+extern struct bio_set drbd_read_split_bio_set;
+
 extern struct drbd_peer_device *create_peer_device(struct drbd_device *, struct drbd_connection *);
 extern enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsigned int minor,
 					     struct device_conf *device_conf, struct drbd_device **p_device);
@@ -1877,6 +2028,26 @@ extern void conn_free_crypto(struct drbd_connection *connection);
 /* drbd_req */
 extern void drbd_wake_all_senders(struct drbd_resource *resource);
 extern void do_submit(struct work_struct *ws);
+extern void drbd_submit_after_al_transaction(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests);
+extern void drbd_fail_after_al_transaction(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests);
+
+/* Returns the submit queue new writes should go to.
+ * In percpu_submit mode, this disables preemption until the matching
+ * drbd_put_submit_queue(), so the work is queued on the same CPU. */
+static inline struct submit_queue *drbd_get_submit_queue(struct drbd_device *device)
+{
+	if (device->submit.percpu)
+		return get_cpu_ptr(device->submit.percpu);
+	return &device->submit.single;
+}
+
+static inline void drbd_put_submit_queue(struct drbd_device *device)
+{
+	if (device->submit.percpu)
+		put_cpu_ptr(device->submit.percpu);
+}
 #ifndef CONFIG_DRBD_TIMING_STATS
 #define __drbd_make_request(d,b,k,j) __drbd_make_request(d,b,j)
 #endif
@@ -2059,6 +2230,7 @@ extern int drbd_submit_peer_request(struct drbd_peer_request *);
 extern void drbd_cleanup_after_failed_submit_peer_request(struct drbd_peer_request *peer_req);
 extern void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head *cleanup);
 extern int drbd_free_peer_reqs(struct drbd_connection *, struct list_head *, bool is_net_ee);
+extern void drbd_net_pages_released(struct drbd_transport *transport);
 extern struct drbd_peer_request *drbd_alloc_peer_req(struct drbd_peer_device *, gfp_t) __must_hold(local);
 extern void __drbd_free_peer_req(struct drbd_peer_request *, int);
 #define drbd_free_peer_req(pr) __drbd_free_peer_req(pr, 0)
@@ -2119,7 +2291,10 @@ int drbd_seq_show(struct seq_file *seq, void *v);
 extern bool drbd_al_try_lock(struct drbd_device *device);
 extern bool drbd_al_try_lock_for_transaction(struct drbd_device *device);
 extern int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *i);
-extern void drbd_al_begin_io_commit(struct drbd_device *device);
+extern int drbd_al_begin_io_commit(struct drbd_device *device);
+extern bool drbd_al_begin_io_commit_async(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests);
+extern void drbd_al_commit_work(struct work_struct *ws);
 extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i);
 extern int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
@@ -2741,6 +2916,22 @@ static inline struct drbd_connection *first_connection(struct drbd_resource *res
 #define ktime_get_accounting(V) V = ktime_get()
 #define ktime_get_accounting_assign(V, T) V = T
 #define ktime_var_for_accounting(V) ktime_t V = ktime_get()
+
+/* lock-free; may be called with any locks held and irqs disabled */
+static inline void drbd_lat_hist_add(struct drbd_lat_hist __percpu *hist,
+				     ktime_t from, ktime_t to)
+{
+	s64 us;
+	unsigned int b;
+
+	/* the histograms are optional, and not every phase happens */
+	if (!hist || !ktime_to_ns(from) || !ktime_to_ns(to))
+		return;
+
+	us = ktime_us_delta(to, from);
+	b = us <= 0 ? 0 : min_t(unsigned int, fls64(us), DRBD_LAT_BUCKETS - 1);
+	this_cpu_inc(hist->bucket[b]);
+}
 #else
 #define ktime_aggregate_delta(D, ST, M)
 #define ktime_aggregate(D, R, M)
@@ -95,6 +95,39 @@ MODULE_PARM_DESC(allow_oos, "DONT USE!");
 module_param_named(disable_sendpage, drbd_disable_sendpage, bool, 0644);
 module_param_named(allow_oos, drbd_allow_oos, bool, 0);
 
+/* Only evaluated when a device is created */
+bool drbd_percpu_submit;
+MODULE_PARM_DESC(percpu_submit, "Use one activity log submit queue per CPU");
+module_param_named(percpu_submit, drbd_percpu_submit, bool, 0644);
+
+bool drbd_peer_write_offload;
+MODULE_PARM_DESC(peer_write_offload, "Submit mirrored writes from per-volume workers instead of the receiver");
+module_param_named(peer_write_offload, drbd_peer_write_offload, bool, 0644);
+
+/* Only evaluated when the bitmap is allocated on attach */
+bool drbd_contiguous_bitmap;
+MODULE_PARM_DESC(contiguous_bitmap, "Keep the in-core bitmap of each peer in contiguous pages");
+module_param_named(contiguous_bitmap, drbd_contiguous_bitmap, bool, 0644);
+
+unsigned int drbd_al_pipeline_depth = 1;
+MODULE_PARM_DESC(al_pipeline_depth, "Activity log transactions in flight per device (1: synchronous)");
+module_param_named(al_pipeline_depth, drbd_al_pipeline_depth, uint, 0644);
+
+/* Only evaluated when the activity log is allocated on attach or resize */
+unsigned int drbd_al_transaction_blocks = 1;
+MODULE_PARM_DESC(al_transaction_blocks, "Max 4k blocks written per activity log commit (1-8)");
+module_param_named(al_transaction_blocks, drbd_al_transaction_blocks, uint, 0644);
+
+/* Overrides the read-balancing policy of the disk configuration */
+bool drbd_latency_read_balancing;
+MODULE_PARM_DESC(latency_read_balancing, "Send each read to the target with the lowest expected latency");
+module_param_named(latency_read_balancing, drbd_latency_read_balancing, bool, 0644);
+
+unsigned int drbd_diskless_read_stripe_kb;
+MODULE_PARM_DESC(diskless_read_stripe_kb, "Split reads of diskless nodes into chunks of this many KiB "
+		 "to be served by several peers (0: off)");
+module_param_named(diskless_read_stripe_kb, drbd_diskless_read_stripe_kb, uint, 0644);
+
 /* module parameters shared with defaults */
 unsigned int drbd_minor_count = DRBD_MINOR_COUNT_DEF;
 /* Module parameter for setting the user mode helper program
@@ -145,6 +178,8 @@ mempool_t drbd_ee_mempool;
 mempool_t drbd_md_io_page_pool;
 struct bio_set drbd_md_io_bio_set;
 struct bio_set drbd_io_bio_set;
+struct bio_set drbd_read_split_bio_set;
+struct workqueue_struct *drbd_bm_wq;	/* bm_parallel_count(), send_bitmap_parallel() */
 
 /* I do not use a standard mempool, because:
    1) I want to hand out the pre-allocated objects first.
@@ -163,12 +198,12 @@ static const struct block_device_operations drbd_ops = {
 	.release = drbd_release,
 };
 
-struct bio *bio_alloc_drbd(gfp_t gfp_mask)
+struct bio *bio_alloc_drbd(gfp_t gfp_mask, unsigned int nr_iovecs)
 {
 	if (!bioset_initialized(&drbd_md_io_bio_set))
-		return bio_alloc(gfp_mask, 1);
+		return bio_alloc(gfp_mask, nr_iovecs);
 
-	return bio_alloc_bioset(gfp_mask, 1, &drbd_md_io_bio_set);
+	return bio_alloc_bioset(gfp_mask, nr_iovecs, &drbd_md_io_bio_set);
 }
 
 #ifdef __CHECKER__
@@ -884,26 +919,47 @@ static void prepare_header(struct drbd_connection *connection, int vnr,
 		prepare_header80(buffer, cmd, size);
 }
 
+static struct page *alloc_send_buffer_page(unsigned int size, gfp_t gfp_mask)
+{
+	if (size == PAGE_SIZE)
+		return alloc_page(gfp_mask);
+	return alloc_pages(gfp_mask | __GFP_COMP, get_order(size));
+}
+
 static void new_or_recycle_send_buffer_page(struct drbd_send_buffer *sbuf)
 {
+	bool waited = false;
+
 	while (1) {
 		struct page *page;
-		int count = page_count(sbuf->page);
-
-		BUG_ON(count == 0);
-		if (count == 1)
-			goto have_page;
+		unsigned int i, idx;
+
+		/* Prefer the next buffer in the ring the network is done with */
+		for (i = 1; i <= DRBD_SEND_BUFFER_RING; i++) {
+			idx = (sbuf->ring_idx + i) % DRBD_SEND_BUFFER_RING;
+			BUG_ON(page_count(sbuf->ring[idx]) == 0);
+			if (page_count(sbuf->ring[idx]) == 1)
+				goto have_page;
+		}
 
-		page = alloc_page(GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+		idx = (sbuf->ring_idx + 1) % DRBD_SEND_BUFFER_RING;
+		page = alloc_send_buffer_page(sbuf->size,
+				GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
 		if (page) {
-			put_page(sbuf->page);
-			sbuf->page = page;
+			put_page(sbuf->ring[idx]);
+			sbuf->ring[idx] = page;
 			goto have_page;
 		}
 
+		if (!waited) {
+			sbuf->waited++;
+			waited = true;
+		}
 		schedule_timeout_uninterruptible(HZ / 10);
 	}
 have_page:
+	sbuf->ring_idx = idx;
+	sbuf->page = sbuf->ring[idx];
 	sbuf->unsent =
 	sbuf->pos = page_address(sbuf->page);
 }
@@ -914,7 +970,7 @@ static char *alloc_send_buffer(struct drbd_connection *connection, int size,
 	struct drbd_send_buffer *sbuf = &connection->send_buffer[drbd_stream];
 	char *page_start = page_address(sbuf->page);
 
-	if (sbuf->pos - page_start + size > PAGE_SIZE) {
+	if (sbuf->pos - page_start + size > sbuf->size) {
 		flush_send_buffer(connection, drbd_stream);
 		new_or_recycle_send_buffer_page(sbuf);
 	}
@@ -1635,7 +1691,7 @@ static void dcbp_set_pad_bits(struct p_compressed_bm *p, int n)
 static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 				struct p_compressed_bm *p,
 				unsigned int size,
-				struct bm_xfer_ctx *c)
+				struct bm_xfer_ctx *c, bool force)
 {
 	struct bitstream bs;
 	unsigned long plain_bits;
@@ -1671,7 +1727,7 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 	do {
 		tmp = (toggle == 0) ? _drbd_bm_find_next_zero(peer_device, c->bit_offset)
 				    : _drbd_bm_find_next(peer_device, c->bit_offset);
-		if (tmp == -1UL)
+		if (tmp == -1UL || tmp > c->bm_bits)
 			tmp = c->bm_bits;
 		rl = tmp - c->bit_offset;
 
@@ -1710,7 +1766,7 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 
 	len = bs.cur.b - p->code + !!bs.cur.bit;
 
-	if (plain_bits < (len << 3)) {
+	if (plain_bits < (len << 3) && !force) {
 		/* incompressible with this method.
 		 * we need to rewind both word and bit position. */
 		c->bit_offset -= plain_bits;
@@ -1729,6 +1785,80 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 	return len;
 }
 
+/**
+ * fill_bitmap_packet() - Encode the next bitmap packet
+ * @peer_device: DRBD peer device.
+ * @p: Payload buffer.
+ * @size: Bytes available at @p.
+ * @c: Transfer context; advanced past what got encoded.
+ * @segment: @c ends at a segment boundary before the end of the bitmap.
+ * @cmd: Set to P_COMPRESSED_BITMAP or P_BITMAP.
+ *
+ * Returns the payload length, or a negative error code.
+ *
+ * The receiver expects every P_BITMAP but the last one to be completely
+ * filled, so within a segment we cannot fall back to a short plain packet at
+ * the segment end.  We encode that tail with RLE, even if it does not
+ * compress, or return -EAGAIN if RLE is not available.
+ */
+static int fill_bitmap_packet(struct drbd_peer_device *peer_device, void *p, unsigned int size,
+			      struct bm_xfer_ctx *c, bool segment, enum drbd_packet *cmd)
+{
+	struct p_compressed_bm *pc = p;
+	unsigned long *pu = p;
+	unsigned long num_words;
+	u64 start = ktime_get_ns();
+	int len;
+
+	len = fill_bitmap_rle_bits(peer_device, pc, size - sizeof(*pc), c, false);
+	if (len == 0 && segment && c->bm_words - c->word_offset < size / sizeof(*pu)) {
+		len = fill_bitmap_rle_bits(peer_device, pc, size - sizeof(*pc), c, true);
+		if (len == 0)
+			return -EAGAIN;
+	}
+	if (len < 0)
+		return -EIO;
+
+	if (len) {
+		dcbp_set_code(pc, RLE_VLI_Bits);
+		*cmd = P_COMPRESSED_BITMAP;
+		c->code_ns += ktime_get_ns() - start;
+		return sizeof(*pc) + len;
+	}
+
+	/* was not compressible.
+	 * send a buffer full of plain text bits instead. */
+	num_words = min_t(size_t, size / sizeof(*pu), c->bm_words - c->word_offset);
+	len = num_words * sizeof(*pu);
+	if (len)
+		drbd_bm_get_lel(peer_device, c->word_offset, num_words, pu);
+
+	c->word_offset += num_words;
+	c->bit_offset = c->word_offset * BITS_PER_LONG;
+	if (c->bit_offset > c->bm_bits)
+		c->bit_offset = c->bm_bits;
+
+	*cmd = P_BITMAP;
+	c->code_ns += ktime_get_ns() - start;
+	return len;
+}
+
+/* The payload has to be in the prepared send buffer already. */
+static int __send_bitmap_packet(struct drbd_peer_device *peer_device, struct bm_xfer_ctx *c,
+				enum drbd_packet cmd, unsigned int len)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int header_size = drbd_header_size(connection);
+	int err;
+
+	resize_prepared_command(connection, DATA_STREAM, len);
+	err = __send_command(connection, peer_device->device->vnr, cmd, DATA_STREAM);
+	c->packets[cmd == P_BITMAP]++;
+	c->bytes[cmd == P_BITMAP] += header_size + len;
+
+	return err;
+}
+
 /**
  * send_bitmap_rle_or_plain
  *
@@ -1738,63 +1868,191 @@ static int fill_bitmap_rle_bits(struct drbd_peer_device *peer_device,
 static int
 send_bitmap_rle_or_plain(struct drbd_peer_device *peer_device, struct bm_xfer_ctx *c)
 {
-	struct drbd_device *device = peer_device->device;
-	unsigned int header_size = drbd_header_size(peer_device->connection);
-	struct p_compressed_bm *pc;
-	int len, err;
-
-	pc = (struct p_compressed_bm *)
-		(alloc_send_buffer(peer_device->connection, DRBD_SOCKET_BUFFER_SIZE, DATA_STREAM) + header_size);
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int header_size = drbd_header_size(connection);
+	enum drbd_packet cmd;
+	void *p;
+	int len;
 
-	len = fill_bitmap_rle_bits(peer_device, pc,
-			DRBD_SOCKET_BUFFER_SIZE - header_size - sizeof(*pc), c);
+	p = alloc_send_buffer(connection, DRBD_SOCKET_BUFFER_SIZE, DATA_STREAM) + header_size;
+	len = fill_bitmap_packet(peer_device, p, DRBD_SOCKET_BUFFER_SIZE - header_size,
+				 c, false, &cmd);
 	if (len < 0)
 		return -EIO;
 
-	if (len) {
-		dcbp_set_code(pc, RLE_VLI_Bits);
-		resize_prepared_command(peer_device->connection, DATA_STREAM, sizeof(*pc) + len);
-		err = __send_command(peer_device->connection, device->vnr,
-				     P_COMPRESSED_BITMAP, DATA_STREAM);
-		c->packets[0]++;
-		c->bytes[0] += header_size + sizeof(*pc) + len;
+	if (__send_bitmap_packet(peer_device, c, cmd, len))
+		return -EIO;
 
-		if (c->bit_offset >= c->bm_bits)
-			len = 0; /* DONE */
-	} else {
-		/* was not compressible.
-		 * send a buffer full of plain text bits instead. */
-		unsigned int data_size;
-		unsigned long num_words;
-		unsigned long *pu = (unsigned long *)pc;
-
-		data_size = DRBD_SOCKET_BUFFER_SIZE - header_size;
-		num_words = min_t(size_t, data_size / sizeof(*pu),
-				  c->bm_words - c->word_offset);
-		len = num_words * sizeof(*pu);
-		if (len)
-			drbd_bm_get_lel(peer_device, c->word_offset, num_words, pu);
-
-		resize_prepared_command(peer_device->connection, DATA_STREAM, len);
-		err = __send_command(peer_device->connection, device->vnr, P_BITMAP, DATA_STREAM);
-
-		c->word_offset += num_words;
-		c->bit_offset = c->word_offset * BITS_PER_LONG;
+	/* an RLE packet that reached the end, or the empty P_BITMAP
+	 * following the last plain one, finishes the transfer */
+	if (cmd == P_COMPRESSED_BITMAP ? c->bit_offset >= c->bm_bits : len == 0) {
+		INFO_bm_xfer_stats(peer_device, "send", c);
+		return 0;
+	}
+	return 1;
+}
+
+/* Large bitmaps are cut into segments that get encoded concurrently on the
+ * unbound workqueue, while the sender streams the finished segments in
+ * order.  Segment boundaries are 64 bit aligned, and the packets of each
+ * segment are exactly what the sequential encoder would produce starting at
+ * that offset, so the receiver cannot tell the difference. */
+#define BM_XFER_SEGMENT_BITS	(1UL << 23)
+#define BM_XFER_MIN_SEGMENTS	4
+#define BM_XFER_MAX_IN_FLIGHT	8U
+
+struct bm_xfer_packet {
+	struct list_head list;
+	enum drbd_packet cmd;
+	unsigned int len;
+	char data[];
+};
+
+struct bm_xfer_segment {
+	struct work_struct work;
+	struct drbd_peer_device *peer_device;
+	unsigned int payload_size;
+	unsigned long start, end;
+	struct list_head packets;
+	struct completion done;
+	u64 code_ns;
+	int err;
+};
 
-		c->packets[1]++;
-		c->bytes[1] += header_size + len;
+static void bm_xfer_encode_segment(struct work_struct *ws)
+{
+	struct bm_xfer_segment *s = container_of(ws, struct bm_xfer_segment, work);
+	struct drbd_device *device = s->peer_device->device;
+	bool last = s->end == drbd_bm_bits(device);
+	struct bm_xfer_ctx c = {
+		.bm_bits = s->end,
+		.bm_words = last ? drbd_bm_words(device) : s->end / BITS_PER_LONG,
+		.bit_offset = s->start,
+	};
+	struct bm_xfer_packet *packet;
+	int len;
+
+	bm_xfer_ctx_bit_to_word_offset(&c);
+	for (;;) {
+		packet = kmalloc(sizeof(*packet) + s->payload_size, GFP_NOIO);
+		if (!packet) {
+			s->err = -ENOMEM;
+			break;
+		}
+		len = fill_bitmap_packet(s->peer_device, packet->data, s->payload_size,
+					 &c, !last, &packet->cmd);
+		if (len < 0) {
+			kfree(packet);
+			s->err = len;
+			break;
+		}
+		packet->len = len;
+		list_add_tail(&packet->list, &s->packets);
 
-		if (c->bit_offset > c->bm_bits)
-			c->bit_offset = c->bm_bits;
+		if (c.bit_offset < c.bm_bits)
+			continue;
+		/* as in the sequential case, a plain tail
+		 * is terminated by an empty P_BITMAP */
+		if (!(last && packet->cmd == P_BITMAP && len))
+			break;
 	}
-	if (!err) {
-		if (len == 0) {
-			INFO_bm_xfer_stats(peer_device, "send", c);
-			return 0;
-		} else
-			return 1;
+	s->code_ns = c.code_ns;
+	complete(&s->done);
+}
+
+static void bm_xfer_free_packets(struct bm_xfer_segment *s)
+{
+	struct bm_xfer_packet *packet, *tmp;
+
+	list_for_each_entry_safe(packet, tmp, &s->packets, list) {
+		list_del(&packet->list);
+		kfree(packet);
+	}
+}
+
+static bool bm_xfer_parallel_ok(struct drbd_peer_device *peer_device, struct bm_xfer_ctx *c)
+{
+	bool use_rle;
+
+	if (num_online_cpus() < 2 || c->bm_bits < BM_XFER_MIN_SEGMENTS * BM_XFER_SEGMENT_BITS)
+		return false;
+
+	/* segment tails need RLE, see fill_bitmap_packet() */
+	rcu_read_lock();
+	use_rle = rcu_dereference(peer_device->connection->transport.net_conf)->use_rle;
+	rcu_read_unlock();
+
+	return use_rle;
+}
+
+/* Return values as send_bitmap_rle_or_plain().  If a segment could not be
+ * encoded, @c points to its start, and the caller continues sequentially. */
+static int send_bitmap_parallel(struct drbd_peer_device *peer_device, struct bm_xfer_ctx *c)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int header_size = drbd_header_size(connection);
+	unsigned long nr_segments = DIV_ROUND_UP(c->bm_bits, BM_XFER_SEGMENT_BITS);
+	unsigned long queued = 0, sent;
+	struct bm_xfer_segment *segs, *s;
+	struct bm_xfer_packet *packet;
+	unsigned int window;
+	int err = 0;
+
+	window = min_t(unsigned long, min(num_online_cpus(), BM_XFER_MAX_IN_FLIGHT), nr_segments);
+	segs = kcalloc(window, sizeof(*segs), GFP_NOIO);
+	if (!segs)
+		return 1;
+
+	for (sent = 0; sent < nr_segments; sent++) {
+		for (; queued < nr_segments && queued < sent + window; queued++) {
+			s = &segs[queued % window];
+			INIT_WORK(&s->work, bm_xfer_encode_segment);
+			INIT_LIST_HEAD(&s->packets);
+			init_completion(&s->done);
+			s->peer_device = peer_device;
+			s->payload_size = DRBD_SOCKET_BUFFER_SIZE - header_size;
+			s->start = queued * BM_XFER_SEGMENT_BITS;
+			s->end = min(c->bm_bits, s->start + BM_XFER_SEGMENT_BITS);
+			s->err = 0;
+			queue_work(drbd_bm_wq, &s->work);
+		}
+
+		s = &segs[sent % window];
+		wait_for_completion(&s->done);
+		if (s->err) {
+			err = s->err == -EIO ? -EIO : 1;
+			bm_xfer_free_packets(s);
+			break;
+		}
+		list_for_each_entry(packet, &s->packets, list) {
+			void *p = alloc_send_buffer(connection, DRBD_SOCKET_BUFFER_SIZE, DATA_STREAM)
+				+ header_size;
+
+			memcpy(p, packet->data, packet->len);
+			if (__send_bitmap_packet(peer_device, c, packet->cmd, packet->len)) {
+				err = -EIO;
+				break;
+			}
+		}
+		bm_xfer_free_packets(s);
+		if (err)
+			break;
+		c->code_ns += s->code_ns;
+		c->bit_offset = s->end;
+		bm_xfer_ctx_bit_to_word_offset(c);
 	}
-	return -EIO;
+
+	/* reap the segments still being encoded */
+	for (sent++; sent < queued; sent++) {
+		s = &segs[sent % window];
+		wait_for_completion(&s->done);
+		bm_xfer_free_packets(s);
+	}
+	kfree(segs);
+
+	if (!err)
+		INFO_bm_xfer_stats(peer_device, "send", c);
+	return err;
 }
 
 /* See the comment at receive_bitmap() */
@@ -1829,9 +2087,11 @@ static int _drbd_send_bitmap(struct drbd_device *device,
 		.bm_words = drbd_bm_words(device),
 	};
 
-	do {
+	err = 1;
+	if (bm_xfer_parallel_ok(peer_device, &c))
+		err = send_bitmap_parallel(peer_device, &c);
+	while (err > 0)
 		err = send_bitmap_rle_or_plain(peer_device, &c);
-	} while (err > 0);
 
 	return err == 0;
 }
@@ -2597,6 +2857,7 @@ static void drbd_destroy_mempools(void)
 {
 	struct page *page;
 
+	drbd_pp_mag_drain_all();
 	while (drbd_pp_pool) {
 		page = drbd_pp_pool;
 		drbd_pp_pool = page_chain_next(page);
@@ -2606,10 +2867,12 @@ static void drbd_destroy_mempools(void)
 
 	/* D_ASSERT(device, atomic_read(&drbd_pp_vacant)==0); */
 
+	bioset_exit(&drbd_read_split_bio_set);
 	bioset_exit(&drbd_io_bio_set);
 	bioset_exit(&drbd_md_io_bio_set);
 	mempool_exit(&drbd_md_io_page_pool);
 	mempool_exit(&drbd_ee_mempool);
+	drbd_req_cache_drain();
 	mempool_exit(&drbd_request_mempool);
 	if (drbd_ee_cache)
 		kmem_cache_destroy(drbd_ee_cache);
@@ -2630,7 +2893,7 @@ static void drbd_destroy_mempools(void)
 
 static int drbd_create_mempools(void)
 {
-	struct page *page;
+	unsigned int n;
 	const int number = (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count;
 	int i, ret;
 
@@ -2660,6 +2923,10 @@ static int drbd_create_mempools(void)
 	if (ret)
 		goto Enomem;
 
+	ret = bioset_init(&drbd_read_split_bio_set, BIO_POOL_SIZE, 0, 0);
+	if (ret)
+		goto Enomem;
+
 	ret = bioset_init(&drbd_md_io_bio_set, DRBD_MIN_POOL_PAGES, 0,
 			  BIOSET_NEED_BVECS);
 	if (ret)
@@ -2681,14 +2948,13 @@ static int drbd_create_mempools(void)
 	/* drbd's page pool */
 	spin_lock_init(&drbd_pp_lock);
 
-	for (i = 0; i < number; i++) {
-		page = alloc_page(GFP_HIGHUSER);
-		if (!page)
+	for (i = 0; i < number; ) {
+		n = drbd_alloc_page_run(&drbd_pp_pool, number - i, GFP_HIGHUSER);
+		if (!n)
 			goto Enomem;
-		set_page_chain_next_offset_size(page, drbd_pp_pool, 0, 0);
-		drbd_pp_pool = page;
+		i += n;
+		drbd_pp_vacant = i;
 	}
-	drbd_pp_vacant = number;
 
 	return 0;
 
@@ -2705,6 +2971,9 @@ static void free_peer_device(struct drbd_peer_device *peer_device)
 	lc_destroy(peer_device->resync_lru);
 	kfree(peer_device->rs_plan_s);
 	kfree(peer_device->conf);
+#ifdef CONFIG_DRBD_TIMING_STATS
+	free_percpu(peer_device->lat_hist_ack);
+#endif
 	kfree(peer_device);
 }
 
@@ -2724,6 +2993,9 @@ static void drbd_device_finalize_work_fn(struct work_struct *work)
 	put_disk(device->vdisk);
 	blk_cleanup_queue(device->rq_queue);
 
+#ifdef CONFIG_DRBD_TIMING_STATS
+	free_percpu(device->lat_hist);
+#endif
 	kfree(device);
 
 	kref_debug_put(&resource->kref_debug, 4);
@@ -2900,6 +3172,8 @@ static void drbd_cleanup(void)
 
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
+	if (drbd_bm_wq)
+		destroy_workqueue(drbd_bm_wq);
 
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
@@ -3032,31 +3306,56 @@ found:
 
 static void drbd_put_send_buffers(struct drbd_connection *connection)
 {
-	unsigned int i;
+	unsigned int i, j;
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
-		if (connection->send_buffer[i].page) {
-			put_page(connection->send_buffer[i].page);
-			connection->send_buffer[i].page = NULL;
+		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+
+		for (j = 0; j < DRBD_SEND_BUFFER_RING; j++) {
+			if (sbuf->ring[j]) {
+				put_page(sbuf->ring[j]);
+				sbuf->ring[j] = NULL;
+			}
 		}
+		sbuf->page = NULL;
 	}
 }
 
 static int drbd_alloc_send_buffers(struct drbd_connection *connection)
 {
-	unsigned int i;
+	unsigned int i, j;
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
-		struct page *page;
-
-		page = alloc_page(GFP_KERNEL);
-		if (!page) {
-			drbd_put_send_buffers(connection);
-			return -ENOMEM;
+		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+
+		/* Fall back to single pages if memory is too fragmented.
+		 * All entries of the ring have the same size. */
+		sbuf->size = PAGE_SIZE << DRBD_SEND_BUFFER_ORDER;
+retry:
+		for (j = 0; j < DRBD_SEND_BUFFER_RING; j++) {
+			struct page *page;
+
+			page = alloc_send_buffer_page(sbuf->size, sbuf->size == PAGE_SIZE ?
+					GFP_KERNEL : GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+			if (!page && sbuf->size != PAGE_SIZE) {
+				while (j--) {
+					put_page(sbuf->ring[j]);
+					sbuf->ring[j] = NULL;
+				}
+				sbuf->size = PAGE_SIZE;
+				goto retry;
+			}
+			if (!page) {
+				drbd_put_send_buffers(connection);
+				return -ENOMEM;
+			}
+			sbuf->ring[j] = page;
 		}
-		connection->send_buffer[i].page = page;
-		connection->send_buffer[i].unsent =
-		connection->send_buffer[i].pos = page_address(page);
+		sbuf->ring_idx = 0;
+		sbuf->waited = 0;
+		sbuf->page = sbuf->ring[0];
+		sbuf->unsent =
+		sbuf->pos = page_address(sbuf->page);
 	}
 
 	return 0;
@@ -3415,6 +3714,9 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 		kfree(peer_device);
 		return NULL;
 	}
+#ifdef CONFIG_DRBD_TIMING_STATS
+	peer_device->lat_hist_ack = alloc_percpu(struct drbd_lat_hist);
+#endif
 
 	timer_setup(&peer_device->start_resync_timer, start_resync_timer_fn, 0);
 
@@ -3439,19 +3741,60 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	return peer_device;
 }
 
+static void init_submit_queue(struct drbd_device *device, struct submit_queue *q)
+{
+	q->device = device;
+	INIT_WORK(&q->worker, do_submit);
+	INIT_LIST_HEAD(&q->writes);
+	INIT_LIST_HEAD(&q->peer_writes);
+	spin_lock_init(&q->lock);
+}
+
 static int init_submitter(struct drbd_device *device)
 {
-	/* opencoded create_singlethread_workqueue(),
-	 * to be able to use format string arguments */
-	device->submit.wq =
-		alloc_ordered_workqueue("drbd%u_submit", WQ_MEM_RECLAIM, device->minor);
-	if (!device->submit.wq)
+	int cpu;
+
+	init_submit_queue(device, &device->submit.single);
+	device->submit.percpu = NULL;
+
+	/* do_submit() may wait for drbd_al_commit_work(),
+	 * so that must not queue behind it on an ordered submit.wq */
+	device->submit.commit_wq =
+		alloc_ordered_workqueue("drbd%u_al_commit", WQ_MEM_RECLAIM, device->minor);
+	if (!device->submit.commit_wq)
 		return -ENOMEM;
-	INIT_WORK(&device->submit.worker, do_submit);
-	INIT_LIST_HEAD(&device->submit.writes);
-	INIT_LIST_HEAD(&device->submit.peer_writes);
-	spin_lock_init(&device->submit.lock);
+
+	if (!drbd_percpu_submit) {
+		/* opencoded create_singlethread_workqueue(),
+		 * to be able to use format string arguments */
+		device->submit.wq =
+			alloc_ordered_workqueue("drbd%u_submit", WQ_MEM_RECLAIM, device->minor);
+		if (!device->submit.wq)
+			goto fail;
+		return 0;
+	}
+
+	/* One queue and one work item per CPU. A per-cpu workqueue runs
+	 * each work item on the CPU it was queued on. */
+	device->submit.percpu = alloc_percpu(struct submit_queue);
+	if (!device->submit.percpu)
+		goto fail;
+	for_each_possible_cpu(cpu)
+		init_submit_queue(device, per_cpu_ptr(device->submit.percpu, cpu));
+
+	device->submit.wq =
+		alloc_workqueue("drbd%u_submit", WQ_MEM_RECLAIM, 0, device->minor);
+	if (!device->submit.wq) {
+		free_percpu(device->submit.percpu);
+		device->submit.percpu = NULL;
+		goto fail;
+	}
 	return 0;
+
+fail:
+	destroy_workqueue(device->submit.commit_wq);
+	device->submit.commit_wq = NULL;
+	return -ENOMEM;
 }
 
 enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsigned int minor,
@@ -3501,13 +3844,19 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	atomic_set(&device->wait_for_actlog, 0);
 	atomic_set(&device->wait_for_actlog_ecnt, 0);
 	atomic_set(&device->local_cnt, 0);
+	atomic_set(&device->local_read_cnt, 0);
 	atomic_set(&device->rs_sect_ev, 0);
 	atomic_set(&device->md_io.in_use, 0);
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	spin_lock_init(&device->timing_lock);
+	/* statistics only; without them, drbd_lat_hist_add() does nothing */
+	device->lat_hist = __alloc_percpu(sizeof(struct drbd_lat_hist) * DRBD_LAT_PHASES,
+					  __alignof__(struct drbd_lat_hist));
 #endif
 	spin_lock_init(&device->al_lock);
+	INIT_LIST_HEAD(&device->al_transactions);
+	INIT_WORK(&device->al_commit_work, drbd_al_commit_work);
 
 	spin_lock_init(&device->pending_completion_lock);
 	INIT_LIST_HEAD(&device->pending_master_completion[0]);
@@ -3654,6 +4003,9 @@ out_remove_peer_device:
 
 		idr_remove(&connection->peer_devices, device->vnr);
 		list_del(&peer_device->peer_devices);
+#ifdef CONFIG_DRBD_TIMING_STATS
+		free_percpu(peer_device->lat_hist_ack);
+#endif
 		kfree(peer_device);
 		kref_debug_put(&connection->kref_debug, 3);
 		kref_put(&connection->kref, drbd_destroy_connection);
@@ -3673,6 +4025,9 @@ out_no_minor_idr:
 out_no_peer_device:
 	list_for_each_entry_safe(peer_device, tmp_peer_device, &peer_devices, peer_devices) {
 		list_del(&peer_device->peer_devices);
+#ifdef CONFIG_DRBD_TIMING_STATS
+		free_percpu(peer_device->lat_hist_ack);
+#endif
 		kfree(peer_device);
 	}
 
@@ -3689,6 +4044,9 @@ out_no_q:
 		/* kref debugging wants an extra put, see has_refs() */
 	kref_debug_put(&device->kref_debug, 4);
 	kref_debug_destroy(&device->kref_debug);
+#ifdef CONFIG_DRBD_TIMING_STATS
+	free_percpu(device->lat_hist);
+#endif
 	kfree(device);
 	return err;
 }
@@ -3721,6 +4079,10 @@ void drbd_unregister_device(struct drbd_device *device)
 
 	destroy_workqueue(device->submit.wq);
 	device->submit.wq = NULL;
+	destroy_workqueue(device->submit.commit_wq);
+	device->submit.commit_wq = NULL;
+	free_percpu(device->submit.percpu);
+	device->submit.percpu = NULL;
 	del_timer_sync(&device->request_timer);
 }
 
@@ -3896,6 +4258,12 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	drbd_bm_wq = alloc_workqueue("drbd_bm", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_bm_wq) {
+		pr_err("unable to create bitmap workqueue\n");
+		goto fail;
+	}
+
 	drbd_debugfs_init();
 
 	pr_info("initialized. "
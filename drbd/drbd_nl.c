@@ -1855,15 +1855,20 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 	struct lru_cache *n, *t;
 	struct lc_element *e;
 	unsigned int in_use;
+	unsigned int max_pending;
 	int i;
 
+	max_pending = AL_UPDATES_PER_TRANSACTION *
+		clamp_t(unsigned int, drbd_al_transaction_blocks, 1, AL_TRANSACTION_BLOCKS_MAX);
+
 	if (device->act_log &&
-	    device->act_log->nr_elements == dc->al_extents)
+	    device->act_log->nr_elements == dc->al_extents &&
+	    device->act_log->max_pending_changes == max_pending)
 		return 0;
 
 	in_use = 0;
 	t = device->act_log;
-	n = lc_create("act_log", drbd_al_ext_cache, AL_UPDATES_PER_TRANSACTION,
+	n = lc_create("act_log", drbd_al_ext_cache, max_pending,
 		dc->al_extents, sizeof(struct lc_element), 0);
 
 	if (n == NULL) {
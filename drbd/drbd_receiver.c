@@ -210,9 +210,10 @@ static struct drbd_epoch *previous_epoch(struct drbd_connection *connection, str
 
 /* If at least n pages are linked at head, get n pages off.
  * Otherwise, don't modify head, and return NULL.
+ * If tail is given, it is set to the last page of the returned chain.
  * Locking is the responsibility of the caller.
  */
-static struct page *page_chain_del(struct page **head, int n)
+static struct page *page_chain_del(struct page **head, int n, struct page **tail)
 {
 	struct page *page;
 	struct page *tmp;
@@ -239,6 +240,8 @@ static struct page *page_chain_del(struct page **head, int n)
 
 	/* add end of list marker for the returned list */
 	set_page_chain_next(page, NULL);
+	if (tail)
+		*tail = page;
 	/* actual return value, and adjustment of head */
 	page = *head;
 	*head = tmp;
@@ -271,31 +274,212 @@ static int page_chain_free(struct page *page)
 	return i;
 }
 
+/* chain_last has to be the tail of chain_first, the caller knows it anyways.
+ * Walking the chain again here, under the lock, is not worth it. */
 static void page_chain_add(struct page **head,
 		struct page *chain_first, struct page *chain_last)
 {
-#if 1
-	struct page *tmp;
-	tmp = page_chain_tail(chain_first, NULL);
-	BUG_ON(tmp != chain_last);
-#endif
+	BUG_ON(page_chain_next(chain_last));
 
 	/* add chain to head */
 	set_page_chain_next(chain_last, *head);
 	*head = chain_first;
 }
 
+/*
+ * Per CPU page magazines in front of drbd_pp_pool.
+ *
+ * Most page chains are small compared to a magazine, so allocating and
+ * freeing them usually only touches the magazine of the local CPU.
+ * drbd_pp_lock is taken once per batch, when a magazine is refilled from,
+ * or drained into, the global pool. Chains larger than a magazine bypass it.
+ *
+ * drbd_pp_vacant only counts the pages in the global pool. The pages cached
+ * in the magazines are bounded by DRBD_PP_MAG_MAX per CPU; max_buffers and
+ * pp_in_use accounting do not care where a page came from.
+ *
+ * Those cached pages must not be out of reach of an allocation that would
+ * otherwise wait for them: drbd_alloc_pages() drains all magazines into the
+ * global pool before it waits on drbd_pp_wait.  So each magazine has a lock,
+ * which only is contended while draining.
+ *
+ * All of this happens in process context (see drbd_free_pages).
+ */
+#define DRBD_PP_MAG_MAX		128
+#define DRBD_PP_MAG_BATCH	32
+
+struct drbd_pp_mag {
+	spinlock_t lock;
+	struct page *head;
+	unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct drbd_pp_mag, drbd_pp_mag) = {
+	.lock = __SPIN_LOCK_UNLOCKED(drbd_pp_mag.lock),
+};
+
+/* Links a chain of n pages into the global pool,
+ * or returns them to the system if the pool is large enough already. */
+static void drbd_pp_pool_add(struct page *page, struct page *last, unsigned int n)
+{
+	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count) {
+		page_chain_free(page);
+		return;
+	}
+	spin_lock(&drbd_pp_lock);
+	page_chain_add(&drbd_pp_pool, page, last);
+	drbd_pp_vacant += n;
+	spin_unlock(&drbd_pp_lock);
+}
+
+static struct page *drbd_pp_mag_alloc(unsigned int number)
+{
+	struct drbd_pp_mag *mag;
+	struct page *page, *last;
+
+	if (number > DRBD_PP_MAG_MAX)
+		return NULL;
+
+	mag = get_cpu_ptr(&drbd_pp_mag);
+	spin_lock(&mag->lock);
+	if (mag->count < number) {
+		/* refill for this allocation, plus one batch in advance */
+		unsigned int want = min(number - mag->count + DRBD_PP_MAG_BATCH,
+					DRBD_PP_MAG_MAX - mag->count);
+
+		/* racy, see __drbd_alloc_pages */
+		if (drbd_pp_vacant >= want) {
+			spin_lock(&drbd_pp_lock);
+			page = page_chain_del(&drbd_pp_pool, want, &last);
+			if (page)
+				drbd_pp_vacant -= want;
+			spin_unlock(&drbd_pp_lock);
+			if (page) {
+				set_page_chain_next(last, mag->head);
+				mag->head = page;
+				mag->count += want;
+			}
+		}
+	}
+	page = NULL;
+	if (mag->count >= number) {
+		page = page_chain_del(&mag->head, number, NULL);
+		mag->count -= number;
+	}
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(mag);
+
+	return page;
+}
+
+/* Returns false if the chain is too large for the magazine. */
+static bool drbd_pp_mag_free(struct page *page, struct page *last, unsigned int n)
+{
+	struct drbd_pp_mag *mag;
+	struct page *drain = NULL, *drain_last;
+	unsigned int nr_drain = 0;
+
+	if (n > DRBD_PP_MAG_MAX)
+		return false;
+
+	mag = get_cpu_ptr(&drbd_pp_mag);
+	spin_lock(&mag->lock);
+	set_page_chain_next(last, mag->head);
+	mag->head = page;
+	mag->count += n;
+	if (mag->count > DRBD_PP_MAG_MAX) {
+		/* leave room for one batch of frees */
+		nr_drain = mag->count - DRBD_PP_MAG_MAX + DRBD_PP_MAG_BATCH;
+		drain = page_chain_del(&mag->head, nr_drain, &drain_last);
+		mag->count -= nr_drain;
+	}
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(mag);
+
+	if (drain)
+		drbd_pp_pool_add(drain, drain_last, nr_drain);
+	return true;
+}
+
+/* Gives the pages cached in the magazines of all CPUs back to the global
+ * pool (or the system), before we wait for pages, and on module unload. */
+void drbd_pp_mag_drain_all(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_pp_mag *mag = per_cpu_ptr(&drbd_pp_mag, cpu);
+		struct page *page;
+		unsigned int n;
+
+		if (!READ_ONCE(mag->head))
+			continue;
+		spin_lock(&mag->lock);
+		page = mag->head;
+		n = mag->count;
+		mag->head = NULL;
+		mag->count = 0;
+		spin_unlock(&mag->lock);
+		if (page)
+			drbd_pp_pool_add(page, page_chain_tail(page, NULL), n);
+	}
+}
+
+/**
+ * drbd_alloc_page_run() - Prepends up to @max physically contiguous pages to a page chain
+ * @head:	page chain to prepend to
+ * @max:	maximum number of pages wanted
+ * @gfp_mask:	how to allocate
+ *
+ * Opportunistically tries a higher order allocation, without direct reclaim,
+ * and splits it into order 0 pages, so the page pool and all users of page
+ * chains keep working on single pages. The pages of a run are linked in
+ * ascending order: the transport may then receive into them as one segment,
+ * and bio_add_page() merges them into one bio_vec.
+ * Falls back to a single page.
+ *
+ * Returns the number of pages added, 0 if not even a single page was available.
+ */
+unsigned int drbd_alloc_page_run(struct page **head, unsigned int max, gfp_t gfp_mask)
+{
+	unsigned int order = min_t(unsigned int, ilog2(max), PAGE_ALLOC_COSTLY_ORDER);
+	struct page *page = NULL;
+	int i;
+
+	if (order)
+		page = alloc_pages((gfp_mask | __GFP_NOWARN | __GFP_NORETRY) &
+				   ~__GFP_DIRECT_RECLAIM, order);
+	if (page) {
+		split_page(page, order);
+	} else {
+		order = 0;
+		page = alloc_page(gfp_mask);
+		if (!page)
+			return 0;
+	}
+
+	for (i = (1 << order) - 1; i >= 0; i--) {
+		set_page_chain_next_offset_size(page + i, *head, 0, 0);
+		*head = page + i;
+	}
+	return 1 << order;
+}
+
 static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 {
 	struct page *page = NULL;
 	struct page *tmp = NULL;
 	unsigned int i = 0;
 
+	page = drbd_pp_mag_alloc(number);
+	if (page)
+		return page;
+
 	/* Yes, testing drbd_pp_vacant outside the lock is racy.
 	 * So what. It saves a spin_lock. */
 	if (drbd_pp_vacant >= number) {
 		spin_lock(&drbd_pp_lock);
-		page = page_chain_del(&drbd_pp_pool, number);
+		page = page_chain_del(&drbd_pp_pool, number, NULL);
 		if (page)
 			drbd_pp_vacant -= number;
 		spin_unlock(&drbd_pp_lock);
@@ -303,12 +487,11 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 			return page;
 	}
 
-	for (i = 0; i < number; i++) {
-		tmp = alloc_page(gfp_mask);
-		if (!tmp)
+	while (i < number) {
+		unsigned int n = drbd_alloc_page_run(&page, number - i, gfp_mask);
+		if (!n)
 			break;
-		set_page_chain_next_offset_size(tmp, page, 0, 0);
-		page = tmp;
+		i += n;
 	}
 
 	if (i == number)
@@ -319,10 +502,8 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 	 * function "soon". */
 	if (page) {
 		tmp = page_chain_tail(page, NULL);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
+		if (!drbd_pp_mag_free(page, tmp, i))
+			drbd_pp_pool_add(page, tmp, i);
 	}
 	return NULL;
 }
@@ -368,6 +549,18 @@ static void drbd_reclaim_net_peer_reqs(struct drbd_connection *connection)
 		drbd_free_net_peer_req(peer_req);
 }
 
+/* For transports that learn when the network stack dropped its references
+ * to pages handed to it with send_page(), e.g. from MSG_ZEROCOPY completions.
+ * Frees what is done on net_ee right away, instead of leaving it for the
+ * next drbd_alloc_pages() to find. Process context only. */
+void drbd_net_pages_released(struct drbd_transport *transport)
+{
+	struct drbd_connection *connection =
+		container_of(transport, struct drbd_connection, transport);
+
+	drbd_reclaim_net_peer_reqs(connection);
+}
+
 /**
  * drbd_alloc_pages() - Returns @number pages, retries forever (or until signalled)
  * @device:	DRBD device.
@@ -413,6 +606,7 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 		prepare_to_wait(&drbd_pp_wait, &wait, TASK_INTERRUPTIBLE);
 
 		drbd_reclaim_net_peer_reqs(connection);
+		drbd_pp_mag_drain_all();
 
 		if (atomic_read(&connection->pp_in_use) < mxb) {
 			page = __drbd_alloc_pages(number, gfp_mask);
@@ -439,28 +633,23 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 }
 
 /* Must not be used from irq, as that may deadlock: see drbd_alloc_pages.
- * Either links the page chain back to the global pool,
- * or returns all pages to the system. */
+ * Either links the page chain into the magazine of this CPU or the global
+ * pool, or returns all pages to the system. */
 void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is_net)
 {
 	struct drbd_connection *connection =
 		container_of(transport, struct drbd_connection, transport);
 	atomic_t *a = is_net ? &connection->pp_in_use_by_net : &connection->pp_in_use;
+	struct page *tmp;
 	int i;
 
 	if (page == NULL)
 		return;
 
-	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count)
-		i = page_chain_free(page);
-	else {
-		struct page *tmp;
-		tmp = page_chain_tail(page, &i);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
-	}
+	tmp = page_chain_tail(page, &i);
+	if (!drbd_pp_mag_free(page, tmp, i))
+		drbd_pp_pool_add(page, tmp, i);
+
 	i = atomic_sub_return(i, a);
 	if (i < 0)
 		drbd_warn(connection, "ASSERTION FAILED: %s: %d < 0\n",
@@ -498,11 +687,24 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, gfp_t gfp_mask) __must
 	return peer_req;
 }
 
+static void drbd_peer_req_digest_done(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+
+	peer_req->flags &= ~EE_VERIFY_DIGEST;
+	kfree(peer_req->int_dig);
+	peer_req->int_dig = NULL;
+	if (atomic_dec_and_test(&connection->digests_in_flight))
+		wake_up(&connection->ee_wait);
+}
+
 void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
 {
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 
 	might_sleep();
+	if (peer_req->flags & EE_VERIFY_DIGEST)
+		drbd_peer_req_digest_done(peer_req);
 	if (peer_req->flags & EE_HAS_DIGEST)
 		kfree(peer_req->digest);
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
@@ -1540,6 +1742,36 @@ static int peer_request_fault_type(struct drbd_peer_request *peer_req)
 	}
 }
 
+/*
+ * For peer writes received with EE_VERIFY_DIGEST, called by
+ * drbd_submit_peer_request(), whoever submits them. Also sends the
+ * P_RECV_ACK held back until now.
+ * Returns false if the data does not match the digest of the peer.
+ */
+static bool drbd_peer_req_verify_digest(struct drbd_peer_request *peer_req)
+{
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int digest_size = crypto_shash_digestsize(connection->peer_integrity_tfm);
+	void *dig_in = peer_req->int_dig;
+	void *dig_vv = dig_in + digest_size;
+	bool ok;
+
+	drbd_csum_pages(connection->peer_integrity_tfm, peer_req->page_chain.head, dig_vv);
+	ok = !memcmp(dig_in, dig_vv, digest_size);
+	drbd_peer_req_digest_done(peer_req);
+
+	if (!ok) {
+		drbd_err(peer_device, "Digest integrity check FAILED: %llus +%u\n",
+			 (unsigned long long)peer_req->i.sector, peer_req->i.size);
+		return false;
+	}
+
+	if (peer_req->flags & EE_SEND_RECEIVE_ACK)
+		drbd_send_ack(peer_device, P_RECV_ACK, peer_req);
+	return true;
+}
+
 /**
  * drbd_submit_peer_request()
  * @peer_req:	peer request
@@ -1570,6 +1802,9 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 	unsigned nr_pages = peer_req->page_chain.nr_pages;
 	int err = -ENOMEM;
 
+	if (peer_req->flags & EE_VERIFY_DIGEST && !drbd_peer_req_verify_digest(peer_req))
+		return -EIO;
+
 	if (peer_req->flags & EE_SET_OUT_OF_SYNC)
 		drbd_set_out_of_sync(peer_req->peer_device,
 				peer_req->i.sector, peer_req->i.size);
@@ -1591,7 +1826,10 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 		return 0;
 	}
 
-	/* In most cases, we will only need one bio.  But in case the lower
+	/* Physically contiguous pages of the chain (see drbd_alloc_page_run())
+	 * are merged into a single bio_vec by bio_add_page().
+	 *
+	 * In most cases, we will only need one bio.  But in case the lower
 	 * level restrictions happen to be different at this offset on this
 	 * side than those of the sending peer, we may need to submit the
 	 * request in more than one bio.
@@ -1792,6 +2030,22 @@ static void conn_wait_active_ee_empty_or_disconnect(struct drbd_connection *conn
 		|| connection->cstate[NOW] < C_CONNECTED);
 }
 
+/* Peer writes with a deferred digest check may wait in do_submit() for
+ * packets only the receiver reads, and get dropped on disconnect.
+ * Returns true if none are left. */
+static bool conn_wait_digests_checked_or_disconnect(struct drbd_connection *connection)
+{
+	if (atomic_read(&connection->digests_in_flight) == 0)
+		return true;
+
+	drbd_unplug_all_devices(connection);
+
+	wait_event(connection->ee_wait,
+		atomic_read(&connection->digests_in_flight) == 0
+		|| connection->cstate[NOW] < C_CONNECTED);
+	return atomic_read(&connection->digests_in_flight) == 0;
+}
+
 static int receive_Barrier(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_transport_ops *tr_ops = connection->transport.ops;
@@ -1898,9 +2152,12 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
  * 	for write same, it is logical_block_size.
  * both trim and write same have the bi_size ("data len to be affected")
  * as extra argument in the packet header.
+ * defer_digest: only stash the received integrity digest,
+ *	drbd_submit_peer_request() verifies it.
  */
 static struct drbd_peer_request *
-read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_details *d) __must_hold(local)
+read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_details *d,
+	      bool defer_digest) __must_hold(local)
 {
 	struct drbd_device *device = peer_device->device;
 	const uint64_t capacity = drbd_get_capacity(device->this_bdev);
@@ -1960,7 +2217,15 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 		kunmap(page);
 	}
 
-	if (d->digest_size) {
+	if (d->digest_size && defer_digest) {
+		/* room for the received digest, and the one we calculate */
+		peer_req->int_dig = kmalloc(2 * d->digest_size, GFP_NOIO);
+		if (!peer_req->int_dig)
+			goto fail;
+		memcpy(peer_req->int_dig, dig_in, d->digest_size);
+		peer_req->flags |= EE_VERIFY_DIGEST;
+		atomic_inc(&peer_device->connection->digests_in_flight);
+	} else if (d->digest_size) {
 		drbd_csum_pages(peer_device->connection->peer_integrity_tfm, peer_req->page_chain.head, dig_vv);
 		if (memcmp(dig_in, dig_vv, d->digest_size)) {
 			drbd_err(device, "Digest integrity check FAILED: %llus +%u\n",
@@ -2078,7 +2343,7 @@ static int recv_resync_read(struct drbd_peer_device *peer_device,
 	int err;
 	u64 im;
 
-	peer_req = read_in_block(peer_device, d);
+	peer_req = read_in_block(peer_device, d, false);
 	if (!peer_req)
 		return -EIO;
 
@@ -2683,13 +2948,25 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 	return err;
 }
 
-static void drbd_queue_peer_request(struct drbd_device *device, struct drbd_peer_request *peer_req)
+/* With peer_write_offload, all peer writes of a volume go through the single
+ * submit queue. Its one work item never runs concurrently with itself, so
+ * the peer writes are submitted in the order they were received, even if the
+ * receiver thread moves between CPUs.  receive_Data() reads the parameter
+ * once and passes it down, so that toggling it does not send a request down
+ * half of either path. */
+static void drbd_queue_peer_request(struct drbd_device *device, struct drbd_peer_request *peer_req,
+				    bool offload)
 {
+	struct submit_queue *q;
+
 	atomic_inc(&device->wait_for_actlog);
-	spin_lock(&device->submit.lock);
-	list_add_tail(&peer_req->wait_for_actlog, &device->submit.peer_writes);
-	spin_unlock(&device->submit.lock);
-	queue_work(device->submit.wq, &device->submit.worker);
+	q = offload ? &device->submit.single : drbd_get_submit_queue(device);
+	spin_lock(&q->lock);
+	list_add_tail(&peer_req->wait_for_actlog, &q->peer_writes);
+	spin_unlock(&q->lock);
+	queue_work(device->submit.wq, &q->worker);
+	if (!offload)
+		drbd_put_submit_queue(device);
 	/* do_submit() may sleep internally on al_wait, too */
 	wake_up(&device->al_wait);
 }
@@ -2705,7 +2982,7 @@ static void drbd_queue_peer_request(struct drbd_device *device, struct drbd_peer
  *        then wait for available slots to be sufficient.
  */
 static enum { DRBD_PAL_QUEUE, DRBD_PAL_DISCONNECTED, DRBD_PAL_SUBMIT }
-prepare_activity_log(struct drbd_peer_request *peer_req)
+prepare_activity_log(struct drbd_peer_request *peer_req, bool offload)
 {
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 	struct drbd_connection *connection = peer_device->connection;
@@ -2741,7 +3018,12 @@ prepare_activity_log(struct drbd_peer_request *peer_req)
 
 		if  (drbd_al_begin_io_for_peer(peer_device, &peer_req->i))
 			ret = DRBD_PAL_DISCONNECTED;
-	} else if (nr_al_extents != 1 || !drbd_al_begin_io_fastpath(device, &peer_req->i)) {
+	} else if (offload || peer_req->flags & EE_VERIFY_DIGEST ||
+		   nr_al_extents != 1 || !drbd_al_begin_io_fastpath(device, &peer_req->i)) {
+		/* With peer_write_offload, the activity log fast path, building
+		 * the bios and submitting them is left to do_submit() of that
+		 * volume. The receiver only keeps the throttling above.
+		 * A deferred digest check always goes that way. */
 		ret = DRBD_PAL_QUEUE;
 	}
 	if (ret == DRBD_PAL_SUBMIT)
@@ -2760,6 +3042,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	struct net_conf *nc;
 	struct drbd_peer_request *peer_req;
 	struct drbd_peer_request_details d;
+	bool offload, defer_digest;
 	int err, tp;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
@@ -2791,7 +3074,19 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	 * end of this function.
 	 */
 
-	peer_req = read_in_block(peer_device, &d);
+	rcu_read_lock();
+	nc = rcu_dereference(connection->transport.net_conf);
+	tp = nc->two_primaries;
+	rcu_read_unlock();
+
+	offload = READ_ONCE(drbd_peer_write_offload);
+
+	/* When the submitter takes the write anyways, let it check the
+	 * digest as well, and go on receiving the next packet. Not with
+	 * two primaries, conflicting writes may get submitted from elsewhere. */
+	defer_digest = offload && !tp;
+
+	peer_req = read_in_block(peer_device, &d, defer_digest);
 	if (!peer_req) {
 		put_ldev(device);
 		return -EIO;
@@ -2879,11 +3174,6 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	}
 	spin_unlock(&connection->epoch_lock);
 
-	rcu_read_lock();
-	nc = rcu_dereference(connection->transport.net_conf);
-	tp = nc->two_primaries;
-	rcu_read_unlock();
-
 	if (d.dp_flags & DP_SEND_WRITE_ACK) {
 		peer_req->flags |= EE_SEND_WRITE_ACK;
 		inc_unacked(peer_device);
@@ -2894,7 +3184,10 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	if (d.dp_flags & DP_SEND_RECEIVE_ACK) {
 		/* I really don't like it that the receiver thread
 		 * sends on the msock, but anyways */
-		drbd_send_ack(peer_device, P_RECV_ACK, peer_req);
+		if (peer_req->flags & EE_VERIFY_DIGEST)
+			peer_req->flags |= EE_SEND_RECEIVE_ACK;
+		else
+			drbd_send_ack(peer_device, P_RECV_ACK, peer_req);
 	}
 
 	if (tp) {
@@ -2925,7 +3218,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	list_add_tail(&peer_req->recv_order, &connection->peer_requests);
 	spin_unlock_irq(&connection->peer_reqs_lock);
 
-	err = prepare_activity_log(peer_req);
+	err = prepare_activity_log(peer_req, offload);
 	if (err == DRBD_PAL_DISCONNECTED)
 		goto disconnect_during_al_begin_io;
 
@@ -2946,7 +3239,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	atomic_inc(&connection->active_ee_cnt);
 
 	if (err == DRBD_PAL_QUEUE) {
-		drbd_queue_peer_request(device, peer_req);
+		drbd_queue_peer_request(device, peer_req, offload);
 		return 0;
 	}
 
@@ -4251,6 +4544,10 @@ static int receive_protocol(struct drbd_connection *connection, struct packet_in
 		}
 	}
 
+	/* deferred digest checks still use the old peer_integrity_tfm */
+	if (!conn_wait_digests_checked_or_disconnect(connection))
+		goto disconnect;
+
 	new_net_conf = kmalloc(sizeof(struct net_conf), GFP_KERNEL);
 	if (!new_net_conf) {
 		drbd_err(connection, "Allocation of new net_conf failed\n");
@@ -6674,6 +6971,7 @@ receive_bitmap_plain(struct drbd_peer_device *peer_device, unsigned int size,
 	unsigned int num_words = min_t(size_t, data_size / sizeof(*p),
 				       c->bm_words - c->word_offset);
 	unsigned int want = num_words * sizeof(*p);
+	u64 start;
 	int err;
 
 	if (want != size) {
@@ -6686,7 +6984,9 @@ receive_bitmap_plain(struct drbd_peer_device *peer_device, unsigned int size,
 	if (err)
 		return err;
 
+	start = ktime_get_ns();
 	drbd_bm_merge_lel(peer_device, c->word_offset, num_words, p);
+	c->code_ns += ktime_get_ns() - start;
 
 	c->word_offset += num_words;
 	c->bit_offset = c->word_offset * BITS_PER_LONG;
@@ -6792,8 +7092,14 @@ decode_bitmap_c(struct drbd_peer_device *peer_device,
 		struct bm_xfer_ctx *c,
 		unsigned int len)
 {
-	if (dcbp_get_code(p) == RLE_VLI_Bits)
-		return recv_bm_rle_bits(peer_device, p, c, len - sizeof(*p));
+	u64 start = ktime_get_ns();
+	int err;
+
+	if (dcbp_get_code(p) == RLE_VLI_Bits) {
+		err = recv_bm_rle_bits(peer_device, p, c, len - sizeof(*p));
+		c->code_ns += ktime_get_ns() - start;
+		return err;
+	}
 
 	/* other variants had been implemented for evaluation,
 	 * but have been dropped as this one turned out to be "best"
@@ -6833,11 +7139,12 @@ void INFO_bm_xfer_stats(struct drbd_peer_device *peer_device,
 
 	r = 1000 - r;
 	drbd_info(peer_device, "%s bitmap stats [Bytes(packets)]: plain %u(%u), RLE %u(%u), "
-	     "total %u; compression: %u.%u%%\n",
+	     "total %u; compression: %u.%u%%, coding %llu usec\n",
 			direction,
 			c->bytes[1], c->packets[1],
 			c->bytes[0], c->packets[0],
-			total, r/10, r % 10);
+			total, r/10, r % 10,
+			(unsigned long long)div_u64(c->code_ns, NSEC_PER_USEC));
 }
 
 static enum drbd_disk_state read_disk_state(struct drbd_device *device)
@@ -8814,3 +9121,4 @@ void drbd_send_peer_ack_wf(struct work_struct *ws)
 
 EXPORT_SYMBOL(drbd_alloc_pages); /* for transports */
 EXPORT_SYMBOL(drbd_free_pages);
+EXPORT_SYMBOL(drbd_net_pages_released);
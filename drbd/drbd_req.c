@@ -35,15 +35,88 @@ static void _drbd_end_io_acct(struct drbd_device *device, struct drbd_request *r
 			    req->start_jif);
 }
 
+/* A few recently freed requests per CPU, in front of drbd_request_mempool.
+ * Chained through ->destroy_next.  Only touched with local irqs disabled,
+ * drbd_reclaim_req() runs from RCU callbacks. */
+#define DRBD_REQ_CACHE_MAX 32
+
+struct drbd_req_cache {
+	struct drbd_request *head;
+	unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct drbd_req_cache, drbd_req_cache);
+
+static struct drbd_request *drbd_req_alloc(void)
+{
+	struct drbd_req_cache *cache;
+	struct drbd_request *req;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(&drbd_req_cache);
+	req = cache->head;
+	if (req) {
+		cache->head = req->destroy_next;
+		cache->count--;
+	}
+	local_irq_restore(flags);
+
+	return req ?: mempool_alloc(&drbd_request_mempool, GFP_NOIO);
+}
+
+static void drbd_req_free(struct drbd_request *req)
+{
+	struct drbd_req_cache *cache;
+	unsigned long flags;
+
+	/* refill the reserve of the mempool first */
+	if (READ_ONCE(drbd_request_mempool.curr_nr) < drbd_request_mempool.min_nr)
+		goto mempool;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(&drbd_req_cache);
+	if (cache->count < DRBD_REQ_CACHE_MAX) {
+		req->destroy_next = cache->head;
+		cache->head = req;
+		cache->count++;
+		req = NULL;
+	}
+	local_irq_restore(flags);
+	if (!req)
+		return;
+mempool:
+	mempool_free(req, &drbd_request_mempool);
+}
+
+/* on module unload */
+void drbd_req_cache_drain(void)
+{
+	struct drbd_request *req;
+	int cpu;
+
+	rcu_barrier(); /* pending drbd_reclaim_req() */
+	for_each_possible_cpu(cpu) {
+		struct drbd_req_cache *cache = per_cpu_ptr(&drbd_req_cache, cpu);
+
+		while ((req = cache->head)) {
+			cache->head = req->destroy_next;
+			mempool_free(req, &drbd_request_mempool);
+		}
+		cache->count = 0;
+	}
+}
+
 static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio *bio_src)
 {
 	struct drbd_request *req;
 
-	req = mempool_alloc(&drbd_request_mempool, GFP_NOIO);
+	req = drbd_req_alloc();
 	if (!req)
 		return NULL;
 
-	memset(req, 0, sizeof(*req));
+	/* pre_send_jif[] and friends need no clearing, see struct drbd_request */
+	memset(req, 0, offsetof(struct drbd_request, pre_send_jif));
 
 	kref_get(&device->kref);
 	kref_debug_get(&device->kref_debug, 6);
@@ -80,7 +153,7 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 void drbd_reclaim_req(struct rcu_head *rp)
 {
 	struct drbd_request *req = container_of(rp, struct drbd_request, rcu);
-	mempool_free(req, &drbd_request_mempool);
+	drbd_req_free(req);
 }
 
 static u64 peer_ack_mask(struct drbd_request *req)
@@ -233,6 +306,15 @@ void drbd_req_destroy(struct kref *kref)
 #ifdef CONFIG_DRBD_TIMING_STATS
 	if (s & RQ_WRITE) {
 
+		if (device->lat_hist) {
+			drbd_lat_hist_add(device->lat_hist + DRBD_LAT_AL_WAIT,
+					  req->start_kt, req->in_actlog_kt);
+			drbd_lat_hist_add(device->lat_hist + DRBD_LAT_LOCAL,
+					  req->pre_submit_kt, req->local_done_kt);
+			drbd_lat_hist_add(device->lat_hist + DRBD_LAT_MASTER,
+					  req->start_kt, req->master_done_kt);
+		}
+
 		spin_lock(&device->timing_lock); /* local irq already disabled */
 		device->reqs++;
 		ktime_aggregate(device, req, in_actlog_kt);
@@ -245,6 +327,8 @@ void drbd_req_destroy(struct kref *kref)
 			ktime_aggregate_pd(peer_device, node_id, req, pre_send_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, acked_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, net_done_kt);
+			drbd_lat_hist_add(peer_device->lat_hist_ack,
+					  req->pre_send_kt[node_id], req->acked_kt[node_id]);
 		}
 		spin_unlock(&device->timing_lock);
 	}
@@ -272,12 +356,17 @@ void drbd_req_destroy(struct kref *kref)
 		return;
 	}
 
-	spin_lock(&resource->tl_update_lock); /* local irq already disabled */
-	destroy_next = req->destroy_next;
-	list_del_rcu(&req->tl_requests);
-	if (resource->tl_previous_write == req)
-		resource->tl_previous_write = NULL;
-	spin_unlock(&resource->tl_update_lock);
+	/* Empty flushes, and reads we failed early, never made it onto the
+	 * transfer log, and can not be anyone's destroy_next either. */
+	destroy_next = NULL;
+	if (!list_empty(&req->tl_requests)) {
+		spin_lock(&resource->tl_update_lock); /* local irq already disabled */
+		destroy_next = req->destroy_next;
+		list_del_rcu(&req->tl_requests);
+		if (resource->tl_previous_write == req)
+			resource->tl_previous_write = NULL;
+		spin_unlock(&resource->tl_update_lock);
+	}
 
 	/* finally remove the request from the conflict detection
 	 * respective block_id verification interval tree. */
@@ -518,6 +607,7 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 
 	/* Update disk stats */
 	_drbd_end_io_acct(device, req);
+	ktime_get_accounting(req->master_done_kt);
 
 	/* If READ failed,
 	 * have it be pushed back to the retry work queue,
@@ -669,6 +759,17 @@ static unsigned int req_payload_sectors(struct drbd_request *req)
 	return req->i.size >> 9;
 }
 
+/* Feed the latency of a completed read into the estimate for its target. */
+static void drbd_read_lat_sample(struct drbd_read_lat *rl, ktime_t start_kt)
+{
+	unsigned long ns = ktime_to_ns(ktime_sub(ktime_get(), start_kt));
+	unsigned long avg = READ_ONCE(rl->ewma_ns);
+
+	avg = avg ? avg - (avg >> 3) + (ns >> 3) : ns;
+	WRITE_ONCE(rl->ewma_ns, avg);
+	WRITE_ONCE(rl->last_sample, jiffies);
+}
+
 /* I'd like this to be the only place that manipulates
  * req->completion_ref and req->kref. */
 static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
@@ -723,8 +824,11 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 
 	kref_get(&req->kref);
 
-	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING))
+	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING)) {
 		atomic_inc(&req->completion_ref);
+		if (!(req->local_rq_state & RQ_WRITE))
+			atomic_inc(&req->device->local_read_cnt);
+	}
 
 	if (!(old_net & RQ_NET_PENDING) && (set & RQ_NET_PENDING)) {
 		inc_ap_pending(peer_device);
@@ -763,6 +867,12 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	if ((old_local & RQ_LOCAL_PENDING) && (clear_local & RQ_LOCAL_PENDING)) {
 		struct drbd_device *device = req->device;
 
+		ktime_get_accounting(req->local_done_kt);
+		if (!(req->local_rq_state & RQ_WRITE)) {
+			atomic_dec(&device->local_read_cnt);
+			if (req->rb_start_kt && (req->local_rq_state & RQ_LOCAL_OK))
+				drbd_read_lat_sample(&device->read_lat, req->rb_start_kt);
+		}
 		if (req->local_rq_state & RQ_LOCAL_ABORTED)
 			kref_put(&req->kref, drbd_req_destroy);
 		else
@@ -776,6 +886,9 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 		dec_ap_pending(peer_device);
 		++c_put;
 		ktime_get_accounting(req->acked_kt[peer_device->node_id]);
+		if (req->rb_start_kt && !(req->local_rq_state & RQ_WRITE) &&
+		    (req->net_rq_state[idx] & RQ_NET_OK))
+			drbd_read_lat_sample(&peer_device->read_lat, req->rb_start_kt);
 		advance_cache_ptr(connection, &connection->req_ack_pending,
 				  req, RQ_NET_SENT | RQ_NET_PENDING, 0);
 	}
@@ -1445,6 +1558,61 @@ static u64 calc_nodes_to_read_from(struct drbd_device *device)
 	return 0;
 }
 
+/* Without a sample for this long, a read target gets the next read, to find
+ * out whether it got faster meanwhile. */
+#define READ_LAT_PROBE_INTERVAL HZ
+
+static bool drbd_read_lat_stale(struct drbd_read_lat *rl)
+{
+	return time_after(jiffies, READ_ONCE(rl->last_sample) + READ_LAT_PROBE_INTERVAL);
+}
+
+/* expected time until one more read on that target completes */
+static unsigned long drbd_read_lat_cost(struct drbd_read_lat *rl, int pending)
+{
+	return READ_ONCE(rl->ewma_ns) * (pending + 1);
+}
+
+/* drbd_latency_read_balancing: the local disk and all UpToDate peers we may
+ * read from compete on drbd_read_lat_cost().  Returns NULL for local. */
+static struct drbd_peer_device *find_fastest_peer_device_for_read(struct drbd_request *req)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_peer_device *peer_device, *best = NULL;
+	unsigned long best_cost = ULONG_MAX, cost;
+	u64 nodes = calc_nodes_to_read_from(device);
+
+	if (req->private_bio) {
+		if (drbd_read_lat_stale(&device->read_lat)) {
+			WRITE_ONCE(device->read_lat.last_sample, jiffies);
+			return NULL;
+		}
+		best_cost = drbd_read_lat_cost(&device->read_lat,
+					       atomic_read(&device->local_read_cnt));
+	}
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		if (!(nodes & NODE_MASK(peer_device->node_id)))
+			continue;
+		if (drbd_read_lat_stale(&peer_device->read_lat)) {
+			WRITE_ONCE(peer_device->read_lat.last_sample, jiffies);
+			best = peer_device;
+			break;
+		}
+		cost = drbd_read_lat_cost(&peer_device->read_lat,
+					  atomic_read(&peer_device->ap_pending_cnt) +
+					  atomic_read(&peer_device->rs_pending_cnt));
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = peer_device;
+		}
+	}
+	rcu_read_unlock();
+
+	return best;
+}
+
 /* If this returns NULL, and req->private_bio is still set,
  * the request should be submitted locally.
  *
@@ -1469,6 +1637,12 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		}
 	}
 
+	if (drbd_latency_read_balancing) {
+		req->rb_start_kt = ktime_get();
+		peer_device = find_fastest_peer_device_for_read(req);
+		goto out;
+	}
+
 	if (device->disk_state[NOW] > D_DISKLESS) {
 		rcu_read_lock();
 		rbm = rcu_dereference(device->ldev->disk_conf)->read_balancing;
@@ -1499,6 +1673,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		break;
 	}
 
+out:
 	if (peer_device && req->private_bio) {
 		bio_put(req->private_bio);
 		req->private_bio = NULL;
@@ -1565,7 +1740,7 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 	 * In case the last activity log transaction failed to get on
 	 * stable storage, and this is a WRITE, we may not even submit
 	 * this bio. */
-	if (get_ldev(device)) {
+	if (!(req->local_rq_state & RQ_AL_FAILED) && get_ldev(device)) {
 		if (drbd_insert_fault(device, type)) {
 			bio->bi_status = BLK_STS_IOERR;
 			bio_endio(bio);
@@ -1586,16 +1761,20 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 
 static void drbd_queue_write(struct drbd_device *device, struct drbd_request *req)
 {
+	struct submit_queue *q;
+
 	if (req->private_bio)
 		atomic_inc(&device->ap_actlog_cnt);
-	spin_lock(&device->submit.lock);
-	list_add_tail(&req->list, &device->submit.writes);
-	spin_unlock(&device->submit.lock);
 	spin_lock_irq(&device->pending_completion_lock);
 	list_add_tail(&req->req_pending_master_completion,
 			&device->pending_master_completion[1 /* WRITE */]);
 	spin_unlock_irq(&device->pending_completion_lock);
-	queue_work(device->submit.wq, &device->submit.worker);
+	q = drbd_get_submit_queue(device);
+	spin_lock(&q->lock);
+	list_add_tail(&req->list, &q->writes);
+	spin_unlock(&q->lock);
+	queue_work(device->submit.wq, &q->worker);
+	drbd_put_submit_queue(device);
 	/* do_submit() may sleep internally on al_wait, too */
 	wake_up(&device->al_wait);
 }
@@ -2041,16 +2220,21 @@ static void wfa_init(struct waiting_for_act_log *wfa)
 	list_splice_tail_init(&(_wfa)->peer_requests.from, &(_wfa)->peer_requests.to); \
 	} while (0)
 
-static void __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
+static void drbd_peer_req_in_actlog(struct drbd_peer_request *peer_req)
 {
-	struct drbd_peer_device *peer_device = peer_req->peer_device;
-	struct drbd_device *device = peer_device->device;
-	int err;
+	struct drbd_device *device = peer_req->peer_device->device;
 
 	peer_req->flags |= EE_IN_ACTLOG;
 	atomic_sub(interval_to_al_extents(&peer_req->i), &device->wait_for_actlog_ecnt);
 	atomic_dec(&device->wait_for_actlog);
 	list_del_init(&peer_req->wait_for_actlog);
+}
+
+static void __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
+{
+	int err;
+
+	drbd_peer_req_in_actlog(peer_req);
 
 	err = drbd_submit_peer_request(peer_req);
 
@@ -2157,17 +2341,18 @@ static bool prepare_al_transaction_nonblock(struct drbd_device *device,
 	return made_progress;
 }
 
-static void send_and_submit_pending(struct drbd_device *device, struct waiting_for_act_log *wfa)
+void drbd_submit_after_al_transaction(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests)
 {
 	struct blk_plug plug;
 	struct drbd_request *req, *tmp;
 	struct drbd_peer_request *pr, *pr_tmp;
 
 	blk_start_plug(&plug);
-	list_for_each_entry_safe(pr, pr_tmp, &wfa->peer_requests.pending, wait_for_actlog) {
+	list_for_each_entry_safe(pr, pr_tmp, peer_requests, wait_for_actlog) {
 		__drbd_submit_peer_request(pr);
 	}
-	list_for_each_entry_safe(req, tmp, &wfa->requests.pending, list) {
+	list_for_each_entry_safe(req, tmp, requests, list) {
 		drbd_req_in_actlog(req);
 		atomic_dec(&device->ap_actlog_cnt);
 		list_del_init(&req->list);
@@ -2176,33 +2361,77 @@ static void send_and_submit_pending(struct drbd_device *device, struct waiting_f
 	blk_finish_plug(&plug);
 }
 
+/* The activity log transaction these have been parked on did not make it
+ * to stable storage, so their extents may not be covered on disk.
+ * drbd_al_commit_work() already reported a meta data error.  Nothing of
+ * them goes to the local disk: fail the peer requests like a failed submit,
+ * and fail the local part of the requests like a local write error.  The
+ * requests are still sent to the peers. */
+void drbd_fail_after_al_transaction(struct drbd_device *device,
+		struct list_head *requests, struct list_head *peer_requests)
+{
+	struct drbd_request *req, *tmp;
+	struct drbd_peer_request *pr, *pr_tmp;
+
+	list_for_each_entry_safe(pr, pr_tmp, peer_requests, wait_for_actlog) {
+		drbd_peer_req_in_actlog(pr);
+		drbd_cleanup_after_failed_submit_peer_request(pr);
+	}
+	list_for_each_entry_safe(req, tmp, requests, list) {
+		drbd_req_in_actlog(req);
+		req->local_rq_state |= RQ_AL_FAILED;
+		atomic_dec(&device->ap_actlog_cnt);
+		list_del_init(&req->list);
+		drbd_send_and_submit(device, req);
+	}
+}
+
+static void send_and_submit_pending(struct drbd_device *device, struct waiting_for_act_log *wfa)
+{
+	drbd_submit_after_al_transaction(device,
+			&wfa->requests.pending, &wfa->peer_requests.pending);
+}
+
 /* more: for non-blocking fill-up # of updates in the transaction */
-static bool grab_new_incoming_requests(struct drbd_device *device, struct waiting_for_act_log *wfa, bool more)
+static bool grab_new_incoming_requests(struct submit_queue *q, struct waiting_for_act_log *wfa, bool more)
 {
 	/* grab new incoming requests */
 	struct list_head *reqs = more ? &wfa->requests.more_incoming : &wfa->requests.incoming;
 	struct list_head *peer_reqs = more ? &wfa->peer_requests.more_incoming : &wfa->peer_requests.incoming;
 	bool found_new = false;
 
-	spin_lock(&device->submit.lock);
-	found_new = !list_empty(&device->submit.writes);
-	list_splice_tail_init(&device->submit.writes, reqs);
-	found_new |= !list_empty(&device->submit.peer_writes);
-	list_splice_tail_init(&device->submit.peer_writes, peer_reqs);
-	spin_unlock(&device->submit.lock);
+	spin_lock(&q->lock);
+	found_new = !list_empty(&q->writes);
+	list_splice_tail_init(&q->writes, reqs);
+	found_new |= !list_empty(&q->peer_writes);
+	list_splice_tail_init(&q->peer_writes, peer_reqs);
+	spin_unlock(&q->lock);
 
 	return found_new;
 }
 
+/* With percpu_submit, one instance of do_submit() may run per CPU.
+ * Each one collects its own batch of requests waiting for the activity log.
+ * prepare_al_transaction_nonblock() backs off while another instance holds
+ * the activity log locked for its transaction, and drbd_al_begin_io_commit()
+ * writes all changes pending at that point in one single transaction,
+ * no matter which instance prepared them.
+ * So more submit queues do not mean more activity log transactions.
+ *
+ * With al_pipeline_depth > 1, drbd_al_begin_io_commit_async() does not wait
+ * for the transaction to reach stable storage.  It parks our pending
+ * (peer-)requests on that transaction, and we go on preparing the next one.
+ * drbd_al_commit_work() submits them once it completed. */
 void do_submit(struct work_struct *ws)
 {
-	struct drbd_device *device = container_of(ws, struct drbd_device, submit.worker);
+	struct submit_queue *q = container_of(ws, struct submit_queue, worker);
+	struct drbd_device *device = q->device;
 	struct waiting_for_act_log wfa;
 	bool made_progress;
 
 	wfa_init(&wfa);
 
-	grab_new_incoming_requests(device, &wfa, false);
+	grab_new_incoming_requests(q, &wfa, false);
 
 	for (;;) {
 		DEFINE_WAIT(wait);
@@ -2265,7 +2494,7 @@ void do_submit(struct work_struct *ws)
 			/* Nothing moved to pending, but nothing left
 			 * on incoming: all moved to "later"!
 			 * Grab new and iterate. */
-			grab_new_incoming_requests(device, &wfa, false);
+			grab_new_incoming_requests(q, &wfa, false);
 		}
 		finish_wait(&device->al_wait, &wait);
 
@@ -2288,11 +2517,11 @@ void do_submit(struct work_struct *ws)
 		while (wfa_lists_empty(&wfa, incoming)) {
 			/* It is ok to look outside the lock,
 			 * it's only an optimization anyways */
-			if (list_empty(&device->submit.writes) &&
-			    list_empty(&device->submit.peer_writes))
+			if (list_empty(&q->writes) &&
+			    list_empty(&q->peer_writes))
 				break;
 
-			if (!grab_new_incoming_requests(device, &wfa, true))
+			if (!grab_new_incoming_requests(q, &wfa, true))
 				break;
 
 			made_progress = prepare_al_transaction_nonblock(device, &wfa);
@@ -2304,10 +2533,45 @@ void do_submit(struct work_struct *ws)
 		if (!list_empty(&wfa.peer_requests.cleanup))
 			drbd_cleanup_peer_requests_wfa(device, &wfa.peer_requests.cleanup);
 
-		drbd_al_begin_io_commit(device);
+		if (!drbd_al_begin_io_commit_async(device,
+				&wfa.requests.pending, &wfa.peer_requests.pending))
+			send_and_submit_pending(device, &wfa);
+	}
+}
 
-		send_and_submit_pending(device, &wfa);
+/* Split a large read of a diskless node at stripe boundaries, so that the
+ * chunks are spread over all UpToDate peers by find_peer_device_for_read().
+ * Each chunk becomes a request of its own, which also means that it is
+ * retried on some other peer by itself, if its peer fails it.
+ * Returns what remains of @bio. */
+#ifndef CONFIG_DRBD_TIMING_STATS
+#define drbd_stripe_read(d,b,k,j) drbd_stripe_read(d,b,j)
+#endif
+static struct bio *drbd_stripe_read(struct drbd_device *device, struct bio *bio,
+				    ktime_t start_kt, unsigned long start_jif)
+{
+	unsigned int stripe_kb = READ_ONCE(drbd_diskless_read_stripe_kb);
+	unsigned int stripe_sectors, sectors;
+	struct bio *split;
+
+	if (!stripe_kb || bio_op(bio) != REQ_OP_READ ||
+	    device->disk_state[NOW] != D_DISKLESS)
+		return bio;
+
+	stripe_sectors = rounddown_pow_of_two(max(stripe_kb, 4U) << 1);
+	if (bio_sectors(bio) <= stripe_sectors ||
+	    hweight64(calc_nodes_to_read_from(device)) < 2)
+		return bio;
+
+	for (;;) {
+		sectors = stripe_sectors - (bio->bi_iter.bi_sector & (stripe_sectors - 1));
+		if (bio_sectors(bio) <= sectors)
+			break;
+		split = bio_split(bio, sectors, GFP_NOIO, &drbd_read_split_bio_set);
+		bio_chain(split, bio);
+		__drbd_make_request(device, split, start_kt, start_jif);
 	}
+	return bio;
 }
 
 blk_qc_t drbd_make_request(struct request_queue *q, struct bio *bio)
@@ -2329,6 +2593,7 @@ blk_qc_t drbd_make_request(struct request_queue *q, struct bio *bio)
 	ktime_get_accounting(start_kt);
 	start_jif = jiffies;
 
+	bio = drbd_stripe_read(device, bio, start_kt, start_jif);
 	__drbd_make_request(device, bio, start_kt, start_jif);
 
 	return BLK_QC_T_NONE;
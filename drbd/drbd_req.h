@@ -221,6 +221,10 @@ enum drbd_req_state_bits {
 	 * but was not, because of drbd_suspended() */
 	__RQ_COMPLETION_SUSP,
 
+	/* The activity log transaction covering this write
+	 * did not make it to stable storage; never submit it locally */
+	__RQ_AL_FAILED,
+
 };
 #define RQ_NET_PENDING     (1UL << __RQ_NET_PENDING)
 #define RQ_NET_QUEUED      (1UL << __RQ_NET_QUEUED)
@@ -251,6 +255,7 @@ enum drbd_req_state_bits {
 #define RQ_UNPLUG          (1UL << __RQ_UNPLUG)
 #define RQ_POSTPONED	   (1UL << __RQ_POSTPONED)
 #define RQ_COMPLETION_SUSP (1UL << __RQ_COMPLETION_SUSP)
+#define RQ_AL_FAILED       (1UL << __RQ_AL_FAILED)
 
 
 /* these flags go into local_rq_state,
@@ -262,7 +267,8 @@ enum drbd_req_state_bits {
 	 RQ_IN_ACT_LOG	|\
 	 RQ_POSTPONED	|\
 	 RQ_UNPLUG	|\
-	 RQ_COMPLETION_SUSP)
+	 RQ_COMPLETION_SUSP |\
+	 RQ_AL_FAILED)
 
 /* For waking up the frozen transfer log mod_req() has to return if the request
    should be counted in the epoch object*/
@@ -0,0 +1,840 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_loop.c
+
+   This file is part of DRBD.
+
+   In-kernel loopback transport: connects two DRBD connections on the same
+   host through in-memory queues, so the replication code paths can be
+   benchmarked and profiled without a network stack in between.
+
+   Two connections are paired if the addresses of their first paths mirror
+   each other. The addresses are never bound, they only serve as names.
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <drbd_protocol.h>
+#include <drbd_transport.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_AUTHOR("LINBIT HA-Solutions GmbH");
+MODULE_DESCRIPTION("In-kernel loopback transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+/* Queued bytes a sender may have outstanding per stream, if the
+ * sndbuf-size of the connection is not set. */
+#define DTL_DEFAULT_QUEUE_SIZE	(1U << 20)
+#define DTL_MAX_SPARE		64
+
+/* A piece of the byte stream. Full pages sent with send_page() get a chunk
+ * of their own, recv_pages() hands those over into the page chain of the
+ * receiver instead of copying them. */
+struct dtl_chunk {
+	struct list_head list;
+	struct page *page;
+	unsigned int offset;	/* received up to here */
+	unsigned int len;	/* valid bytes in page */
+	bool whole;
+};
+
+struct dtl_queue {
+	spinlock_t lock;
+	struct list_head chunks;
+	unsigned int bytes;		/* queued, not yet received */
+	wait_queue_head_t wait;		/* for data, or for room */
+	struct list_head spare;		/* recycled chunks for the sender */
+	unsigned int nr_spare;
+};
+
+/* Shared by both ends of a loop connection */
+struct dtl_pair {
+	struct kref kref;
+	bool closed;
+	struct dtl_queue queue[2][2];	/* [receiving side][stream] */
+};
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+struct drbd_loop_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	struct dtl_pair *pair;
+	int side;
+	unsigned int sndbuf;
+	long rcvtimeo[2];
+	struct buffer rbuf[2];
+
+	/* while waiting in dtl_connect() for the other end */
+	struct list_head connect_list;
+	wait_queue_head_t connect_wait;
+	struct sockaddr_storage my_addr;
+	struct sockaddr_storage peer_addr;
+
+	atomic64_t pages_handed_over;
+	atomic64_t pages_copied;
+};
+
+static int dtl_init(struct drbd_transport *transport);
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtl_connect(struct drbd_transport *transport);
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtl_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtl_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtl_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class loop_transport_class = {
+	.name = "loop",
+	.instance_size = sizeof(struct drbd_loop_transport),
+	.path_instance_size = sizeof(struct drbd_path),
+	.listener_instance_size = sizeof(struct drbd_listener),
+	.module = THIS_MODULE,
+	.init = dtl_init,
+	.list = LIST_HEAD_INIT(loop_transport_class.list),
+};
+
+static struct drbd_transport_ops dtl_ops = {
+	.free = dtl_free,
+	.connect = dtl_connect,
+	.recv = dtl_recv,
+	.recv_pages = dtl_recv_pages,
+	.stats = dtl_stats,
+	.set_rcvtimeo = dtl_set_rcvtimeo,
+	.get_rcvtimeo = dtl_get_rcvtimeo,
+	.send_page = dtl_send_page,
+	.send_zc_bio = dtl_send_zc_bio,
+	.stream_ok = dtl_stream_ok,
+	.hint = dtl_hint,
+	.debugfs_show = dtl_debugfs_show,
+	.add_path = dtl_add_path,
+	.remove_path = dtl_remove_path,
+};
+
+/* Transports waiting in dtl_connect() */
+static LIST_HEAD(dtl_connecting);
+static DEFINE_SPINLOCK(dtl_connecting_lock);
+
+static int dtl_init(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&loop_transport->paths_lock);
+	INIT_LIST_HEAD(&loop_transport->connect_list);
+	init_waitqueue_head(&loop_transport->connect_wait);
+	loop_transport->transport.ops = &dtl_ops;
+	loop_transport->transport.class = &loop_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		loop_transport->rbuf[i].base = buffer;
+		loop_transport->rbuf[i].pos = buffer;
+		loop_transport->rcvtimeo[i] = MAX_SCHEDULE_TIMEOUT;
+	}
+
+	return 0;
+fail:
+	free_page((unsigned long)loop_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static void dtl_free_chunks(struct list_head *list)
+{
+	struct dtl_chunk *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, list, list) {
+		list_del(&c->list);
+		put_page(c->page);
+		kfree(c);
+	}
+}
+
+static struct dtl_pair *dtl_alloc_pair(void)
+{
+	struct dtl_pair *pair;
+	int side, stream;
+
+	pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+	if (!pair)
+		return NULL;
+
+	kref_init(&pair->kref);
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_queue *q = &pair->queue[side][stream];
+
+			spin_lock_init(&q->lock);
+			INIT_LIST_HEAD(&q->chunks);
+			INIT_LIST_HEAD(&q->spare);
+			init_waitqueue_head(&q->wait);
+		}
+	}
+	return pair;
+}
+
+static void dtl_destroy_pair(struct kref *kref)
+{
+	struct dtl_pair *pair = container_of(kref, struct dtl_pair, kref);
+	int side, stream;
+
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			dtl_free_chunks(&pair->queue[side][stream].chunks);
+			dtl_free_chunks(&pair->queue[side][stream].spare);
+		}
+	}
+	kfree(pair);
+}
+
+/* Both ends see end of stream, once they received what is queued already. */
+static void dtl_close_pair(struct dtl_pair *pair)
+{
+	int side, stream;
+
+	WRITE_ONCE(pair->closed, true);
+	for (side = 0; side < 2; side++)
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++)
+			wake_up_all(&pair->queue[side][stream].wait);
+}
+
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct drbd_path *drbd_path;
+	enum drbd_stream i;
+
+	/* mutexes are handled by caller */
+	if (loop_transport->pair) {
+		dtl_close_pair(loop_transport->pair);
+		kref_put(&loop_transport->pair->kref, dtl_destroy_pair);
+		loop_transport->pair = NULL;
+	}
+
+	spin_lock(&loop_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		bool was_established = drbd_path->established;
+		drbd_path->established = false;
+		if (was_established) {
+			spin_unlock(&loop_transport->paths_lock);
+			drbd_path_event(transport, drbd_path);
+			spin_lock(&loop_transport->paths_lock);
+		}
+	}
+	spin_unlock(&loop_transport->paths_lock);
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *tmp;
+
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)loop_transport->rbuf[i].base);
+			loop_transport->rbuf[i].base = NULL;
+		}
+		spin_lock(&loop_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&loop_transport->paths_lock);
+	}
+}
+
+static bool dtl_addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return false;
+	if (a->ss_family == AF_INET6)
+		return !memcmp(a, b, sizeof(struct sockaddr_in6));
+	return !memcmp(a, b, sizeof(struct sockaddr_in));
+}
+
+static int dtl_connect(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct drbd_loop_transport *other, *found = NULL;
+	struct drbd_path *drbd_path;
+	struct dtl_pair *pair;
+	struct net_conf *nc;
+	int connect_int;
+	long timeo;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+	connect_int = nc->connect_int;
+	loop_transport->sndbuf = nc->sndbuf_size ?: DTL_DEFAULT_QUEUE_SIZE;
+	rcu_read_unlock();
+
+	spin_lock(&loop_transport->paths_lock);
+	drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	if (drbd_path) {
+		loop_transport->my_addr = drbd_path->my_addr;
+		loop_transport->peer_addr = drbd_path->peer_addr;
+	}
+	spin_unlock(&loop_transport->paths_lock);
+	if (!drbd_path)
+		return -EDESTADDRREQ;
+
+	pair = dtl_alloc_pair();
+	if (!pair)
+		return -ENOMEM;
+
+	spin_lock(&dtl_connecting_lock);
+	list_for_each_entry(other, &dtl_connecting, connect_list) {
+		if (dtl_addr_equal(&other->my_addr, &loop_transport->peer_addr) &&
+		    dtl_addr_equal(&other->peer_addr, &loop_transport->my_addr)) {
+			found = other;
+			break;
+		}
+	}
+	if (found) {
+		/* The one that waited resolves conflicts */
+		kref_get(&pair->kref);
+		found->side = 1;
+		WRITE_ONCE(found->pair, pair);
+		list_del_init(&found->connect_list);
+		wake_up(&found->connect_wait);
+
+		clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+		loop_transport->side = 0;
+		loop_transport->pair = pair;
+		pair = NULL;
+	} else {
+		list_add_tail(&loop_transport->connect_list, &dtl_connecting);
+	}
+	spin_unlock(&dtl_connecting_lock);
+
+	if (pair) {
+		kfree(pair);
+
+		timeo = wait_event_interruptible_timeout(loop_transport->connect_wait,
+				READ_ONCE(loop_transport->pair), connect_int * HZ);
+
+		spin_lock(&dtl_connecting_lock);
+		list_del_init(&loop_transport->connect_list);
+		spin_unlock(&dtl_connecting_lock);
+
+		if (!loop_transport->pair) {
+			if (drbd_should_abort_listening(transport))
+				return -EAGAIN;
+			return timeo < 0 ? timeo : -EAGAIN;
+		}
+		set_bit(RESOLVE_CONFLICTS, &transport->flags);
+	}
+
+	drbd_path->established = true;
+	drbd_path_event(transport, drbd_path);
+
+	return 0;
+}
+
+static struct dtl_queue *dtl_recv_queue(struct drbd_loop_transport *loop_transport,
+					enum drbd_stream stream)
+{
+	return &loop_transport->pair->queue[loop_transport->side][stream];
+}
+
+static struct dtl_queue *dtl_send_queue(struct drbd_loop_transport *loop_transport,
+					enum drbd_stream stream)
+{
+	return &loop_transport->pair->queue[!loop_transport->side][stream];
+}
+
+/* Caller holds q->lock. Consumed chunks go back to the spare list. */
+static void dtl_chunk_done(struct dtl_queue *q, struct dtl_chunk *c, struct list_head *to_free)
+{
+	list_del(&c->list);
+	if (q->nr_spare < DTL_MAX_SPARE) {
+		list_add(&c->list, &q->spare);
+		q->nr_spare++;
+	} else {
+		list_add(&c->list, to_free);
+	}
+}
+
+/* Caller holds q->lock, and made sure at least len bytes are queued. */
+static void dtl_copy_out(struct dtl_queue *q, void *dst, unsigned int len, struct list_head *to_free)
+{
+	while (len) {
+		struct dtl_chunk *c = list_first_entry(&q->chunks, struct dtl_chunk, list);
+		unsigned int n = min(len, c->len - c->offset);
+		void *src;
+
+		if (n) {
+			src = kmap_atomic(c->page);
+			memcpy(dst, src + c->offset, n);
+			kunmap_atomic(src);
+			c->offset += n;
+			q->bytes -= n;
+			dst += n;
+			len -= n;
+		}
+		if (c->offset == c->len)
+			dtl_chunk_done(q, c, to_free);
+	}
+}
+
+static int dtl_wait_data(struct drbd_loop_transport *loop_transport, struct dtl_queue *q,
+			 unsigned int size, long timeo)
+{
+	struct dtl_pair *pair = loop_transport->pair;
+
+	timeo = wait_event_interruptible_timeout(q->wait,
+			READ_ONCE(q->bytes) >= size || READ_ONCE(pair->closed), timeo);
+	if (timeo < 0)
+		return timeo;
+	if (timeo == 0 && READ_ONCE(q->bytes) < size)
+		return -EAGAIN;
+	return 0;
+}
+
+/* Like kernel_recvmsg(): without MSG_DONTWAIT, waits for all of size,
+ * returns less on end of stream, timeout or signal. */
+static int dtl_recv_into(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			 void *buf, size_t size, int flags)
+{
+	struct dtl_queue *q = dtl_recv_queue(loop_transport, stream);
+	long timeo = flags & MSG_DONTWAIT ? 0 : loop_transport->rcvtimeo[stream];
+	LIST_HEAD(to_free);
+	size_t received = 0;
+	int err = 0;
+
+	while (received < size) {
+		unsigned int n;
+
+		err = dtl_wait_data(loop_transport, q, 1, timeo);
+		if (err)
+			break;
+
+		spin_lock(&q->lock);
+		n = min_t(size_t, q->bytes, size - received);
+		dtl_copy_out(q, buf + received, n, &to_free);
+		spin_unlock(&q->lock);
+		wake_up(&q->wait);
+
+		if (!n) /* closed, and nothing left */
+			break;
+		received += n;
+		if (flags & MSG_DONTWAIT)
+			break;
+	}
+	dtl_free_chunks(&to_free);
+
+	return received ?: err;
+}
+
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	void *buffer;
+	int rv;
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtl_recv_into(loop_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == loop_transport->rbuf[stream].base);
+		buffer = loop_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtl_recv_into(loop_transport, stream, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = loop_transport->rbuf[stream].base;
+
+		rv = dtl_recv_into(loop_transport, stream, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		loop_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_queue *q;
+	struct page *page, *prev = NULL;
+	LIST_HEAD(to_free);
+	int err;
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+	q = dtl_recv_queue(loop_transport, DATA_STREAM);
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	while (page) {
+		struct page *next = page_chain_next(page);
+		unsigned int len = min_t(size_t, size, PAGE_SIZE);
+		struct dtl_chunk *c;
+
+		err = dtl_wait_data(loop_transport, q, len, loop_transport->rcvtimeo[DATA_STREAM]);
+		if (!err && READ_ONCE(q->bytes) < len)
+			err = -ECONNRESET;
+		if (err)
+			goto fail;
+
+		spin_lock(&q->lock);
+		c = list_first_entry(&q->chunks, struct dtl_chunk, list);
+		if (c->whole && c->offset == 0 && len == PAGE_SIZE) {
+			/* Swap pages: the queued one goes into the chain, the
+			 * one from the chain is recycled for the sender. The
+			 * page accounting of the chain stays the same. */
+			struct page *queued = c->page;
+
+			c->page = page;
+			q->bytes -= PAGE_SIZE;
+			dtl_chunk_done(q, c, &to_free);
+
+			set_page_chain_next_offset_size(queued, next, 0, len);
+			if (prev)
+				set_page_chain_next(prev, queued);
+			else
+				chain->head = queued;
+			page = queued;
+			atomic64_inc(&loop_transport->pages_handed_over);
+		} else {
+			void *data = kmap_atomic(page);
+
+			dtl_copy_out(q, data, len, &to_free);
+			kunmap_atomic(data);
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, len);
+			atomic64_inc(&loop_transport->pages_copied);
+		}
+		spin_unlock(&q->lock);
+		wake_up(&q->wait);
+
+		size -= len;
+		prev = page;
+		page = next;
+	}
+	dtl_free_chunks(&to_free);
+	return 0;
+fail:
+	dtl_free_chunks(&to_free);
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (loop_transport->pair) {
+		unsigned int unacked = READ_ONCE(dtl_send_queue(loop_transport, DATA_STREAM)->bytes);
+
+		stats->unread_received = READ_ONCE(dtl_recv_queue(loop_transport, DATA_STREAM)->bytes);
+		stats->unacked_send = unacked;
+		stats->send_buffer_size = loop_transport->sndbuf;
+		stats->send_buffer_used = unacked;
+	}
+}
+
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	loop_transport->rcvtimeo[stream] = timeout;
+}
+
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+
+	return loop_transport->rcvtimeo[stream];
+}
+
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	return loop_transport->pair && !READ_ONCE(loop_transport->pair->closed);
+}
+
+/* Waits until the receiver made room in the queue, like a full socket
+ * send buffer would. */
+static int dtl_wait_room(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			 struct dtl_queue *q)
+{
+	struct drbd_transport *transport = &loop_transport->transport;
+	struct dtl_pair *pair = loop_transport->pair;
+	struct net_conf *nc;
+	long timeo;
+	int err = 0;
+
+	while (READ_ONCE(q->bytes) >= loop_transport->sndbuf) {
+		rcu_read_lock();
+		nc = rcu_dereference(transport->net_conf);
+		timeo = nc ? nc->timeout * HZ / 10 : HZ;
+		rcu_read_unlock();
+
+		set_bit(NET_CONGESTED, &transport->flags);
+		timeo = wait_event_interruptible_timeout(q->wait,
+				READ_ONCE(q->bytes) < loop_transport->sndbuf ||
+				READ_ONCE(pair->closed), timeo);
+		if (timeo < 0) {
+			/* e.g. drbd_thread_stop(); leave the signal to our
+			 * caller, as the TCP transport's send_page() does */
+			err = -EINTR;
+			break;
+		}
+		if (READ_ONCE(pair->closed))
+			break;
+		if (timeo == 0 && drbd_stream_send_timed_out(transport, stream)) {
+			err = -EAGAIN;
+			break;
+		}
+	}
+	clear_bit(NET_CONGESTED, &transport->flags);
+
+	if (!err && READ_ONCE(pair->closed))
+		err = -ECONNRESET;
+	return err;
+}
+
+static struct dtl_chunk *dtl_get_chunk(struct dtl_queue *q)
+{
+	struct dtl_chunk *c;
+
+	spin_lock(&q->lock);
+	c = list_first_entry_or_null(&q->spare, struct dtl_chunk, list);
+	if (c) {
+		list_del(&c->list);
+		q->nr_spare--;
+	}
+	spin_unlock(&q->lock);
+
+	if (!c) {
+		c = kmalloc(sizeof(*c), GFP_NOIO);
+		if (!c)
+			return NULL;
+		c->page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (!c->page) {
+			kfree(c);
+			return NULL;
+		}
+	}
+	c->offset = 0;
+	c->len = 0;
+	c->whole = false;
+	return c;
+}
+
+static void dtl_copy_page(struct page *to, unsigned int to_off,
+			  struct page *from, unsigned int from_off, unsigned int len)
+{
+	void *dst = kmap_atomic(to);
+	void *src = kmap_atomic(from);
+
+	memcpy(dst + to_off, src + from_off, len);
+	kunmap_atomic(src);
+	kunmap_atomic(dst);
+}
+
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_queue *q;
+	struct dtl_chunk *c;
+	int err;
+
+	if (!loop_transport->pair)
+		return -ENOTCONN;
+	q = dtl_send_queue(loop_transport, stream);
+
+	err = dtl_wait_room(loop_transport, stream, q);
+	if (err)
+		return err;
+
+	if (stream == DATA_STREAM && offset == 0 && size == PAGE_SIZE) {
+		c = dtl_get_chunk(q);
+		if (!c)
+			return -ENOMEM;
+		dtl_copy_page(c->page, 0, page, 0, PAGE_SIZE);
+		c->len = PAGE_SIZE;
+		c->whole = true;
+
+		spin_lock(&q->lock);
+		list_add_tail(&c->list, &q->chunks);
+		q->bytes += PAGE_SIZE;
+		spin_unlock(&q->lock);
+		wake_up(&q->wait);
+		return 0;
+	}
+
+	/* Small pieces, e.g. from the send buffer, are appended to the last
+	 * chunk as long as it has room. */
+	while (size) {
+		unsigned int n;
+
+		spin_lock(&q->lock);
+		c = list_empty(&q->chunks) ? NULL :
+			list_last_entry(&q->chunks, struct dtl_chunk, list);
+		if (c && !c->whole && c->len < PAGE_SIZE) {
+			n = min_t(size_t, size, PAGE_SIZE - c->len);
+			dtl_copy_page(c->page, c->len, page, offset, n);
+			c->len += n;
+			q->bytes += n;
+			spin_unlock(&q->lock);
+			wake_up(&q->wait);
+
+			offset += n;
+			size -= n;
+			continue;
+		}
+		spin_unlock(&q->lock);
+
+		c = dtl_get_chunk(q);
+		if (!c)
+			return -ENOMEM;
+		spin_lock(&q->lock);
+		list_add_tail(&c->list, &q->chunks);
+		spin_unlock(&q->lock);
+	}
+	return 0;
+}
+
+static int dtl_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtl_send_page(transport, DATA_STREAM, bvec.bv_page,
+				    bvec.bv_offset, bvec.bv_len,
+				    bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	/* nothing to cork or to ack early, every byte is visible right away */
+	return loop_transport->pair != NULL;
+}
+
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	if (!loop_transport->pair)
+		return;
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+		seq_printf(m, "unread receive queue: %u Byte\n",
+			   READ_ONCE(dtl_recv_queue(loop_transport, i)->bytes));
+		seq_printf(m, "unread send queue: %u Byte\n",
+			   READ_ONCE(dtl_send_queue(loop_transport, i)->bytes));
+	}
+	seq_printf(m, "received pages handed over: %lld copied: %lld\n",
+		   (long long)atomic64_read(&loop_transport->pages_handed_over),
+		   (long long)atomic64_read(&loop_transport->pages_copied));
+}
+
+static int dtl_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	drbd_path->established = false;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_add_tail(&drbd_path->list, &transport->paths);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtl_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int __init dtl_initialize(void)
+{
+	return drbd_register_transport_class(&loop_transport_class,
+					     DRBD_TRANSPORT_API_VERSION,
+					     sizeof(struct drbd_transport));
+}
+
+static void __exit dtl_cleanup(void)
+{
+	drbd_unregister_transport_class(&loop_transport_class);
+}
+
+module_init(dtl_initialize)
+module_exit(dtl_cleanup)
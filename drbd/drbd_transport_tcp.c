@@ -17,6 +17,10 @@
 #include <linux/net.h>
 #include <linux/tcp.h>
 #include <linux/highmem.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/errqueue.h>
+#include <linux/workqueue.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd_config.h>
 #include <drbd_protocol.h>
@@ -38,12 +42,50 @@ struct buffer {
 
 #define DTT_CONNECTING 1
 
+/* The data stream may be striped over several TCP connections of the same
+ * path, DTT_STRIPE_SIZE bytes at a time, round robin. Both sides count the
+ * bytes of the stream, so the receiver knows which socket the next byte
+ * comes from, and the stream stays in order without any extra framing.
+ * stream[DATA_STREAM] is data_socks[0]. */
+#define DTT_MAX_DATA_SOCKS	8
+#define DTT_STRIPE_SHIFT	16
+#define DTT_STRIPE_SIZE		(1U << DTT_STRIPE_SHIFT)
+
+static unsigned int data_sockets = 1;
+module_param(data_sockets, uint, 0644);
+MODULE_PARM_DESC(data_sockets, "TCP connections per data stream (1-8), has to be the same on all nodes; above 1, older peers cannot connect");
+
+/* With zerocopy, full pages of the data stream are sent with MSG_ZEROCOPY.
+ * The completions on the socket error queue tell us when the network stack
+ * released the pages, and we let DRBD free what it was waiting for. */
+static bool zerocopy;
+module_param(zerocopy, bool, 0644);
+MODULE_PARM_DESC(zerocopy, "Send data pages with MSG_ZEROCOPY, takes effect on the next connect");
+
+/* The completion work frees pages drbd_alloc_pages() may wait for under
+ * memory pressure, so it needs a rescuer. */
+static struct workqueue_struct *dtt_zc_wq;
+
+/* drbd_receiver.c */
+void drbd_net_pages_released(struct drbd_transport *transport);
+
 struct drbd_tcp_transport {
 	struct drbd_transport transport; /* Must be first! */
 	spinlock_t paths_lock;
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	struct socket *data_socks[DTT_MAX_DATA_SOCKS];
+	unsigned int nr_data_socks;
+	u64 data_tx_pos; /* serialized by the sender, send_mutex */
+	u64 data_rx_pos; /* only the receiver reads the data stream */
+
+	bool zerocopy;
+	struct work_struct zc_work;
+	void (*original_sk_error_report)(struct sock *sk);
+	atomic64_t zc_sent;
+	atomic64_t zc_completed;
+	atomic64_t zc_copied; /* completions where the stack fell back to copying */
 };
 
 struct dtt_listener {
@@ -83,7 +125,7 @@ static int dtt_send_zc_bio(struct drbd_transport *, struct bio *bio);
 static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
 static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
-static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport);
+static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport, struct socket *socket);
 static int dtt_add_path(struct drbd_transport *, struct drbd_path *path);
 static int dtt_remove_path(struct drbd_transport *, struct drbd_path *);
 
@@ -158,6 +200,8 @@ static void dtt_nodelay(struct socket *socket)
 	(void) kernel_setsockopt(socket, SOL_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
 }
 
+static void dtt_zc_work(struct work_struct *work);
+
 static int dtt_init(struct drbd_transport *transport)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -165,6 +209,7 @@ static int dtt_init(struct drbd_transport *transport)
 	enum drbd_stream i;
 
 	spin_lock_init(&tcp_transport->paths_lock);
+	INIT_WORK(&tcp_transport->zc_work, dtt_zc_work);
 	tcp_transport->transport.ops = &dtt_ops;
 	tcp_transport->transport.class = &tcp_transport_class;
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
@@ -190,6 +235,116 @@ static void dtt_free_one_sock(struct socket *socket)
 	}
 }
 
+static struct socket *dtt_data_socket_nr(struct drbd_tcp_transport *tcp_transport, int i)
+{
+	return i ? tcp_transport->data_socks[i] : tcp_transport->stream[DATA_STREAM];
+}
+
+static void dtt_zc_error_report(struct sock *sk)
+{
+	struct drbd_tcp_transport *tcp_transport;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	tcp_transport = sk->sk_user_data;
+	if (tcp_transport) {
+		tcp_transport->original_sk_error_report(sk);
+		queue_work(dtt_zc_wq, &tcp_transport->zc_work);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/* Consumes the zerocopy completions of all data sockets. The pages of
+ * several sends are typically released by one of them. */
+static void dtt_zc_work(struct work_struct *work)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(work, struct drbd_tcp_transport, zc_work);
+	bool released = false;
+	int i;
+
+	for (i = 0; i < max(tcp_transport->nr_data_socks, 1U); i++) {
+		struct socket *socket = dtt_data_socket_nr(tcp_transport, i);
+		struct sk_buff *skb;
+
+		if (!socket)
+			continue;
+		while ((skb = sock_dequeue_err_skb(socket->sk))) {
+			struct sock_extended_err *ee = &SKB_EXT_ERR(skb)->ee;
+
+			if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+				/* ee_info .. ee_data is the range of completed sends */
+				atomic64_add(ee->ee_data - ee->ee_info + 1, &tcp_transport->zc_completed);
+				if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					atomic64_add(ee->ee_data - ee->ee_info + 1,
+						     &tcp_transport->zc_copied);
+				released = true;
+			}
+			consume_skb(skb);
+		}
+	}
+
+	if (released)
+		drbd_net_pages_released(&tcp_transport->transport);
+}
+
+static void dtt_zc_start(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+{
+	struct sock *sk = socket->sk;
+	int one = 1;
+	int err;
+
+	err = kernel_setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, (char *)&one, sizeof(one));
+	if (err) {
+		tr_warn(&tcp_transport->transport, "Failed to enable SO_ZEROCOPY %d\n", err);
+		tcp_transport->zerocopy = false;
+		return;
+	}
+
+	write_lock_bh(&sk->sk_callback_lock);
+	tcp_transport->original_sk_error_report = sk->sk_error_report;
+	sk->sk_user_data = tcp_transport;
+	sk->sk_error_report = dtt_zc_error_report;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/* Before the data sockets go away */
+static void dtt_zc_stop(struct drbd_tcp_transport *tcp_transport)
+{
+	int i;
+
+	for (i = 0; i < DTT_MAX_DATA_SOCKS; i++) {
+		struct socket *socket = dtt_data_socket_nr(tcp_transport, i);
+		struct sock *sk;
+
+		if (!socket)
+			continue;
+		sk = socket->sk;
+		write_lock_bh(&sk->sk_callback_lock);
+		if (sk->sk_user_data == tcp_transport) {
+			sk->sk_error_report = tcp_transport->original_sk_error_report;
+			sk->sk_user_data = NULL;
+		}
+		write_unlock_bh(&sk->sk_callback_lock);
+	}
+	cancel_work_sync(&tcp_transport->zc_work);
+	tcp_transport->zerocopy = false;
+}
+
+/* The additional data sockets, data_socks[0] is freed as stream[DATA_STREAM] */
+static void dtt_free_data_socks(struct drbd_tcp_transport *tcp_transport)
+{
+	int i;
+
+	for (i = 1; i < DTT_MAX_DATA_SOCKS; i++) {
+		if (tcp_transport->data_socks[i]) {
+			dtt_free_one_sock(tcp_transport->data_socks[i]);
+			tcp_transport->data_socks[i] = NULL;
+		}
+	}
+	tcp_transport->data_socks[0] = NULL;
+	tcp_transport->nr_data_socks = 0;
+}
+
 static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -199,12 +354,14 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 	/* free the socket specific stuff,
 	 * mutexes are handled by caller */
 
+	dtt_zc_stop(tcp_transport);
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		if (tcp_transport->stream[i]) {
 			dtt_free_one_sock(tcp_transport->stream[i]);
 			tcp_transport->stream[i] = NULL;
 		}
 	}
+	dtt_free_data_socks(tcp_transport);
 
 	for_each_path_ref(drbd_path, transport) {
 		bool was_established = drbd_path->established;
@@ -290,6 +447,65 @@ static int dtt_recv_short(struct socket *socket, void *buf, size_t size, int fla
 	return kernel_recvmsg(socket, &msg, &iov, 1, size, msg.msg_flags);
 }
 
+static struct socket *dtt_data_socket(struct drbd_tcp_transport *tcp_transport, u64 pos)
+{
+	unsigned long stripe = pos >> DTT_STRIPE_SHIFT;
+
+	return tcp_transport->data_socks[stripe % tcp_transport->nr_data_socks];
+}
+
+/* Receives from the data stream into iter, crossing stripe boundaries as
+ * necessary. Returns the number of bytes received, or an error if nothing
+ * was received at all. */
+static int dtt_recv_data(struct drbd_tcp_transport *tcp_transport, struct iov_iter *iter, int flags)
+{
+	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	int received = 0;
+
+	if (tcp_transport->nr_data_socks <= 1) {
+		struct msghdr msg = { .msg_flags = flags };
+
+		msg.msg_iter = *iter;
+		return sock_recvmsg(socket, &msg, flags);
+	}
+
+	while (iov_iter_count(iter)) {
+		u64 pos = tcp_transport->data_rx_pos;
+		size_t n = min_t(size_t, iov_iter_count(iter),
+				 DTT_STRIPE_SIZE - (pos & (DTT_STRIPE_SIZE - 1)));
+		struct msghdr msg = { .msg_flags = flags };
+		int rv;
+
+		msg.msg_iter = *iter;
+		iov_iter_truncate(&msg.msg_iter, n);
+		rv = sock_recvmsg(dtt_data_socket(tcp_transport, pos), &msg, flags);
+		if (rv <= 0)
+			return received ?: rv;
+		iov_iter_advance(iter, rv);
+		tcp_transport->data_rx_pos += rv;
+		received += rv;
+		if (rv < n)
+			break;
+	}
+	return received;
+}
+
+static int dtt_recv_buf(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream,
+			void *buf, size_t size, int flags)
+{
+	struct kvec iov = {
+		.iov_base = buf,
+		.iov_len = size,
+	};
+	struct iov_iter iter;
+
+	if (stream != DATA_STREAM || tcp_transport->nr_data_socks <= 1)
+		return dtt_recv_short(tcp_transport->stream[stream], buf, size, flags);
+
+	iov_iter_kvec(&iter, READ, &iov, 1, size);
+	return dtt_recv_data(tcp_transport, &iter, flags ? flags : MSG_WAITALL | MSG_NOSIGNAL);
+}
+
 static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -303,17 +519,17 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 
 	if (flags & CALLER_BUFFER) {
 		buffer = *buf;
-		rv = dtt_recv_short(socket, buffer, size, flags & ~CALLER_BUFFER);
+		rv = dtt_recv_buf(tcp_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
 	} else if (flags & GROW_BUFFER) {
 		TR_ASSERT(transport, *buf == tcp_transport->rbuf[stream].base);
 		buffer = tcp_transport->rbuf[stream].pos;
 		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
 
-		rv = dtt_recv_short(socket, buffer, size, flags & ~GROW_BUFFER);
+		rv = dtt_recv_buf(tcp_transport, stream, buffer, size, flags & ~GROW_BUFFER);
 	} else {
 		buffer = tcp_transport->rbuf[stream].base;
 
-		rv = dtt_recv_short(socket, buffer, size, flags);
+		rv = dtt_recv_buf(tcp_transport, stream, buffer, size, flags);
 		if (rv > 0)
 			*buf = buffer;
 	}
@@ -324,11 +540,16 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	return rv;
 }
 
+/* Number of bio_vecs we pass to a single recvmsg. Physically contiguous
+ * pages of the chain share one of them. */
+#define DTT_RECV_BVECS 16
+
 static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct bio_vec bvec[DTT_RECV_BVECS];
 	struct page *page;
 	int err;
 
@@ -340,16 +561,41 @@ static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_cha
 	if (!page)
 		return -ENOMEM;
 
-	page_chain_for_each(page) {
-		size_t len = min_t(int, size, PAGE_SIZE);
-		void *data = kmap(page);
-		err = dtt_recv_short(socket, data, len, 0);
-		kunmap(page);
-		set_page_chain_offset(page, 0);
-		set_page_chain_size(page, len);
-		if (err < 0)
+	while (page) {
+		struct msghdr msg = {
+			.msg_flags = MSG_WAITALL | MSG_NOSIGNAL
+		};
+		struct bio_vec *bv = NULL;
+		unsigned int n = 0;
+		size_t chunk = 0;
+
+		for (; page; page = page_chain_next(page)) {
+			size_t len = min_t(size_t, size - chunk, PAGE_SIZE);
+
+			if (bv && bv->bv_len % PAGE_SIZE == 0 &&
+			    page_to_pfn(bv->bv_page) + bv->bv_len / PAGE_SIZE == page_to_pfn(page)) {
+				bv->bv_len += len;
+			} else {
+				if (n == DTT_RECV_BVECS)
+					break;
+				bv = &bvec[n++];
+				bv->bv_page = page;
+				bv->bv_offset = 0;
+				bv->bv_len = len;
+			}
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, len);
+			chunk += len;
+		}
+
+		iov_iter_bvec(&msg.msg_iter, READ, bvec, n, chunk);
+		err = dtt_recv_data(tcp_transport, &msg.msg_iter, msg.msg_flags);
+		if (err != chunk) {
+			if (err >= 0)
+				err = -ECONNRESET;
 			goto fail;
-		size -= len;
+		}
+		size -= chunk;
 	}
 	return 0;
 fail:
@@ -488,8 +734,14 @@ out:
 	return err;
 }
 
+/* The length of P_INITIAL_DATA carries the number of data sockets in the
+ * upper byte, and the index of an additional data socket in the lower byte.
+ * Older versions always send 0, which means a single data socket.
+ * This is a change of the wire format of the connection handshake: older
+ * versions ignore the length, so with data_sockets > 1 a node cannot connect
+ * to them.  Both sides give up instead of retrying, see dtt_connect(). */
 static int dtt_send_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
-			     enum drbd_packet cmd, enum drbd_stream stream)
+			     enum drbd_packet cmd, enum drbd_stream stream, u16 length)
 {
 	struct p_header80 h;
 	int msg_flags = 0;
@@ -500,7 +752,7 @@ static int dtt_send_first_packet(struct drbd_tcp_transport *tcp_transport, struc
 
 	h.magic = cpu_to_be32(DRBD_MAGIC);
 	h.command = cpu_to_be16(cmd);
-	h.length = 0;
+	h.length = cpu_to_be16(length);
 
 	err = _dtt_send(tcp_transport, socket, &h, sizeof(h), msg_flags);
 
@@ -695,7 +947,8 @@ retry_locked:
 	goto retry;
 }
 
-static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+				    u16 *length)
 {
 	struct drbd_transport *transport = &tcp_transport->transport;
 	struct p_header80 *h = tcp_transport->rbuf[DATA_STREAM].base;
@@ -723,6 +976,7 @@ static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, st
 			 be32_to_cpu(h->magic));
 		return -EINVAL;
 	}
+	*length = be16_to_cpu(h->length);
 	return be16_to_cpu(h->command);
 }
 
@@ -868,6 +1122,94 @@ static struct dtt_path *dtt_next_path(struct drbd_tcp_transport *tcp_transport,
 	return container_of(drbd_path, struct dtt_path, path);
 }
 
+/* Accepts an additional data socket that came in on the listener of path.
+ * Those only come in after the peer considers the connection established,
+ * which may be before we do. */
+static bool dtt_accept_data_sock(struct drbd_tcp_transport *tcp_transport, struct socket *s,
+				 int fp, u16 length, unsigned int nr)
+{
+	unsigned int i = length & 0xff;
+
+	if (fp != P_INITIAL_DATA || !i || i >= nr || (length >> 8) != nr ||
+	    tcp_transport->data_socks[i])
+		return false;
+
+	tcp_transport->data_socks[i] = s;
+	return true;
+}
+
+static bool dtt_have_data_socks(struct drbd_tcp_transport *tcp_transport, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 1; i < nr; i++)
+		if (!tcp_transport->data_socks[i])
+			return false;
+	return true;
+}
+
+/* Establishes the additional data sockets on path, after the data and
+ * control sockets are there. The node that connected the data socket
+ * connects the additional ones, the other node accepts them. */
+static int dtt_connect_data_socks(struct drbd_transport *transport, struct dtt_path *path,
+				  unsigned int nr, bool active)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct dtt_path *p;
+	struct socket *s;
+	unsigned int i;
+	int tries, err;
+	u16 length;
+
+	if (active) {
+		for (i = 1; i < nr; i++) {
+			tries = 20;
+			do {
+				s = NULL;
+				err = dtt_try_connect(transport, path, &s);
+				if (err == -EAGAIN)
+					schedule_timeout_interruptible(HZ / 10);
+			} while (err == -EAGAIN && --tries && !signal_pending(current));
+			if (err < 0)
+				goto fail;
+			tcp_transport->data_socks[i] = s;
+			err = dtt_send_first_packet(tcp_transport, s, P_INITIAL_DATA, DATA_STREAM,
+						    nr << 8 | i);
+			if (err < 0)
+				goto fail;
+		}
+		return 0;
+	}
+
+	tries = 2;
+	while (!dtt_have_data_socks(tcp_transport, nr)) {
+		s = NULL;
+		err = dtt_wait_for_connect(transport, path->path.listener, &s, &p);
+		if (err == -EAGAIN && --tries)
+			continue;
+		if (err < 0)
+			goto fail;
+
+		err = dtt_receive_first_packet(tcp_transport, s, &length);
+		if (p != path || !dtt_accept_data_sock(tcp_transport, s, err, length, nr)) {
+			kernel_sock_shutdown(s, SHUT_RDWR);
+			sock_release(s);
+		}
+	}
+	return 0;
+
+fail:
+	/* Retrying does not help if the peer does not know about data_sockets,
+	 * or uses a different value */
+	if (err == -EAGAIN) {
+		tr_err(transport, "Could not establish %u data connections, "
+		       "is data_sockets the same on the peer?\n", nr);
+		err = -EPROTO;
+	}
+	return err;
+}
+
 static int dtt_connect(struct drbd_transport *transport)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -875,13 +1217,17 @@ static int dtt_connect(struct drbd_transport *transport)
 	struct drbd_path *drbd_path;
 	struct dtt_path *connect_to_path, *first_path = NULL;
 	struct socket *dsocket, *csocket;
+	unsigned int nr_data = clamp(data_sockets, 1U, (unsigned int)DTT_MAX_DATA_SOCKS);
+	unsigned int peer_nr_data = 1;
+	bool data_active = false;
 	struct net_conf *nc;
-	int timeout, err;
+	int timeout, err, i;
 	int one = 1;
 	bool ok;
 
 	dsocket = NULL;
 	csocket = NULL;
+	dtt_free_data_socks(tcp_transport);
 
 
 	for_each_path_ref(drbd_path, transport) {
@@ -955,11 +1301,13 @@ static int dtt_connect(struct drbd_transport *transport)
 
 			if (use_for_data) {
 				dsocket = s;
-				dtt_send_first_packet(tcp_transport, dsocket, P_INITIAL_DATA, DATA_STREAM);
+				data_active = true;
+				dtt_send_first_packet(tcp_transport, dsocket, P_INITIAL_DATA, DATA_STREAM,
+						      nr_data > 1 ? nr_data << 8 : 0);
 			} else {
 				clear_bit(RESOLVE_CONFLICTS, &transport->flags);
 				csocket = s;
-				dtt_send_first_packet(tcp_transport, csocket, P_INITIAL_META, CONTROL_STREAM);
+				dtt_send_first_packet(tcp_transport, csocket, P_INITIAL_META, CONTROL_STREAM, 0);
 			}
 		} else if (!first_path)
 			connect_to_path = dtt_next_path(tcp_transport, connect_to_path);
@@ -974,7 +1322,8 @@ retry:
 			goto out;
 
 		if (s) {
-			int fp = dtt_receive_first_packet(tcp_transport, s);
+			u16 length = 0;
+			int fp = dtt_receive_first_packet(tcp_transport, s, &length);
 
 			if (!first_path) {
 				first_path = connect_to_path;
@@ -989,6 +1338,16 @@ retry:
 			dtt_socket_ok_or_free(&csocket);
 			switch (fp) {
 			case P_INITIAL_DATA:
+				if (length & 0xff) {
+					/* additional data socket, the peer is there already */
+					if (!dtt_accept_data_sock(tcp_transport, s, fp, length, nr_data)) {
+						kernel_sock_shutdown(s, SHUT_RDWR);
+						sock_release(s);
+					}
+					break;
+				}
+				data_active = false;
+				peer_nr_data = (length >> 8) ?: 1;
 				if (dsocket) {
 					tr_warn(transport, "initial packet S crossed\n");
 					kernel_sock_shutdown(dsocket, SHUT_RDWR);
@@ -1026,6 +1385,19 @@ randomize:
 	} while (!ok);
 
 	TR_ASSERT(transport, first_path == connect_to_path);
+
+	if (!data_active && peer_nr_data != nr_data) {
+		tr_err(transport, "Peer uses %u data connections, we use %u, "
+		       "data_sockets has to be the same on both nodes\n", peer_nr_data, nr_data);
+		err = -EPROTO;
+		goto out;
+	}
+	if (nr_data > 1) {
+		err = dtt_connect_data_socks(transport, connect_to_path, nr_data, data_active);
+		if (err < 0)
+			goto out;
+	}
+
 	connect_to_path->path.established = true;
 	drbd_path_event(transport, &connect_to_path->path);
 	dtt_put_listeners(transport);
@@ -1052,6 +1424,10 @@ randomize:
 
 	tcp_transport->stream[DATA_STREAM] = dsocket;
 	tcp_transport->stream[CONTROL_STREAM] = csocket;
+	tcp_transport->data_socks[0] = dsocket;
+	tcp_transport->nr_data_socks = nr_data;
+	tcp_transport->data_tx_pos = 0;
+	tcp_transport->data_rx_pos = 0;
 
 	rcu_read_lock();
 	nc = rcu_dereference(transport->net_conf);
@@ -1062,9 +1438,26 @@ randomize:
 	dsocket->sk->sk_sndtimeo = timeout;
 	csocket->sk->sk_sndtimeo = timeout;
 
-	err = kernel_setsockopt(dsocket, SOL_SOCKET, SO_KEEPALIVE, (char *)&one, sizeof(one));
-	if (err)
-		tr_warn(transport, "Failed to enable SO_KEEPALIVE %d\n", err);
+	for (i = 1; i < nr_data; i++) {
+		struct socket *s = tcp_transport->data_socks[i];
+
+		s->sk->sk_reuse = SK_CAN_REUSE;
+		s->sk->sk_allocation = GFP_NOIO;
+		s->sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
+		s->sk->sk_sndtimeo = timeout;
+		dtt_nodelay(s);
+	}
+
+	tcp_transport->zerocopy = zerocopy;
+	for (i = 0; i < nr_data && tcp_transport->zerocopy; i++)
+		dtt_zc_start(tcp_transport, tcp_transport->data_socks[i]);
+
+	for (i = 0; i < nr_data; i++) {
+		err = kernel_setsockopt(tcp_transport->data_socks[i], SOL_SOCKET, SO_KEEPALIVE,
+					(char *)&one, sizeof(one));
+		if (err)
+			tr_warn(transport, "Failed to enable SO_KEEPALIVE %d\n", err);
+	}
 
 	return 0;
 
@@ -1073,6 +1466,7 @@ out_eagain:
 
 out:
 	dtt_put_listeners(transport);
+	dtt_free_data_socks(tcp_transport);
 
 	if (dsocket) {
 		kernel_sock_shutdown(dsocket, SHUT_RDWR);
@@ -1091,11 +1485,16 @@ static void dtt_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[stream];
+	int i;
 
 	if (!socket)
 		return;
 
 	socket->sk->sk_rcvtimeo = timeout;
+	if (stream == DATA_STREAM) {
+		for (i = 1; i < tcp_transport->nr_data_socks; i++)
+			tcp_transport->data_socks[i]->sk->sk_rcvtimeo = timeout;
+	}
 }
 
 static long dtt_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
@@ -1119,39 +1518,59 @@ static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream str
 	return socket && socket->sk;
 }
 
-static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
+static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
 {
-	struct socket *socket = tcp_transport->stream[DATA_STREAM];
-	struct sock *sock;
+	struct sock *sock = socket->sk;
 
-	if (!socket)
-		return;
-
-	sock = socket->sk;
 	if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5)
 		set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
 }
 
-static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
-			 struct page *page, int offset, size_t size, unsigned msg_flags)
+/* Smaller sends, e.g. packet headers from the send buffer, are not worth a
+ * zerocopy completion each. */
+#define DTT_ZC_MIN (PAGE_SIZE / 2)
+
+static int dtt_sendpage_zc(struct socket *socket, struct page *page, int offset, size_t size,
+			   unsigned msg_flags)
 {
-	struct drbd_tcp_transport *tcp_transport =
-		container_of(transport, struct drbd_tcp_transport, transport);
-	struct socket *socket = tcp_transport->stream[stream];
+	struct drbd_tcp_transport *tcp_transport = socket->sk->sk_user_data;
+	struct bio_vec bvec = {
+		.bv_page = page,
+		.bv_offset = offset,
+		.bv_len = size,
+	};
+	struct msghdr msg = {
+		.msg_flags = msg_flags | MSG_ZEROCOPY,
+	};
+	int sent;
+
+	iov_iter_bvec(&msg.msg_iter, WRITE, &bvec, 1, size);
+	sent = sock_sendmsg(socket, &msg);
+	if (sent > 0 && tcp_transport)
+		atomic64_inc(&tcp_transport->zc_sent);
+	return sent;
+}
+
+static int dtt_send_page_sock(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream,
+			      struct socket *socket, struct page *page, int offset, size_t size,
+			      unsigned msg_flags)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
 	mm_segment_t oldfs = get_fs();
+	bool use_zc = stream == DATA_STREAM && tcp_transport->zerocopy && size >= DTT_ZC_MIN;
 	int len = size;
 	int err = -EIO;
 
-	if (!socket)
-		return -ENOTCONN;
-
 	msg_flags |= MSG_NOSIGNAL;
-	dtt_update_congested(tcp_transport);
+	dtt_update_congested(tcp_transport, socket);
 	set_fs(KERNEL_DS);
 	do {
 		int sent;
 
-		sent = socket->ops->sendpage(socket, page, offset, len, msg_flags);
+		if (use_zc)
+			sent = dtt_sendpage_zc(socket, page, offset, len, msg_flags);
+		else
+			sent = socket->ops->sendpage(socket, page, offset, len, msg_flags);
 		if (sent <= 0) {
 			if (sent == -EAGAIN) {
 				if (drbd_stream_send_timed_out(transport, stream))
@@ -1182,6 +1601,39 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 	return err;
 }
 
+static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[stream];
+
+	if (!socket)
+		return -ENOTCONN;
+
+	if (stream != DATA_STREAM || tcp_transport->nr_data_socks <= 1)
+		return dtt_send_page_sock(tcp_transport, stream, socket, page, offset, size, msg_flags);
+
+	while (size) {
+		u64 pos = tcp_transport->data_tx_pos;
+		size_t n = min_t(size_t, size, DTT_STRIPE_SIZE - (pos & (DTT_STRIPE_SIZE - 1)));
+		unsigned flags = msg_flags;
+		int err;
+
+		/* A completed stripe will not see more data, push it out. */
+		if (((pos + n) & (DTT_STRIPE_SIZE - 1)) == 0)
+			flags &= ~MSG_MORE;
+		err = dtt_send_page_sock(tcp_transport, stream, dtt_data_socket(tcp_transport, pos),
+					 page, offset, n, flags);
+		if (err)
+			return err;
+		tcp_transport->data_tx_pos += n;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
 static int dtt_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
 {
 	struct bio_vec bvec;
@@ -1220,17 +1672,8 @@ static void dtt_quickack(struct socket *socket)
 	(void) kernel_setsockopt(socket, SOL_TCP, TCP_QUICKACK, (char *)&val, sizeof(val));
 }
 
-static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
-		enum drbd_tr_hints hint)
+static void dtt_hint_one(struct socket *socket, enum drbd_tr_hints hint)
 {
-	struct drbd_tcp_transport *tcp_transport =
-		container_of(transport, struct drbd_tcp_transport, transport);
-	bool rv = true;
-	struct socket *socket = tcp_transport->stream[stream];
-
-	if (!socket)
-		return false;
-
 	switch (hint) {
 	case CORK:
 		dtt_cork(socket);
@@ -1249,10 +1692,28 @@ static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
 		dtt_quickack(socket);
 		break;
 	default: /* not implemented, but should not trigger error handling */
-		return true;
+		break;
 	}
+}
 
-	return rv;
+static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[stream];
+	int i;
+
+	if (!socket)
+		return false;
+
+	dtt_hint_one(socket, hint);
+	if (stream == DATA_STREAM) {
+		for (i = 1; i < tcp_transport->nr_data_socks; i++)
+			dtt_hint_one(tcp_transport->data_socks[i], hint);
+	}
+
+	return true;
 }
 
 static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
@@ -1273,6 +1734,7 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	enum drbd_stream i;
+	unsigned int n;
 
 	/* BUMP me if you change the file format/content/presentation */
 	seq_printf(m, "v: %u\n\n", 0);
@@ -1286,6 +1748,17 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 		}
 	}
 
+	for (n = 1; n < tcp_transport->nr_data_socks; n++) {
+		seq_printf(m, "data stream %u\n", n);
+		dtt_debugfs_show_stream(m, tcp_transport->data_socks[n]);
+	}
+
+	if (tcp_transport->zerocopy)
+		seq_printf(m, "zerocopy sends: %lld completed: %lld copied: %lld\n",
+			   (long long)atomic64_read(&tcp_transport->zc_sent),
+			   (long long)atomic64_read(&tcp_transport->zc_completed),
+			   (long long)atomic64_read(&tcp_transport->zc_copied));
+
 }
 
 static int dtt_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
@@ -1338,14 +1811,24 @@ static int dtt_remove_path(struct drbd_transport *transport, struct drbd_path *d
 
 static int __init dtt_initialize(void)
 {
-	return drbd_register_transport_class(&tcp_transport_class,
-					     DRBD_TRANSPORT_API_VERSION,
-					     sizeof(struct drbd_transport));
+	int err;
+
+	dtt_zc_wq = alloc_workqueue("drbd_tcp_zc", WQ_MEM_RECLAIM, 0);
+	if (!dtt_zc_wq)
+		return -ENOMEM;
+
+	err = drbd_register_transport_class(&tcp_transport_class,
+					    DRBD_TRANSPORT_API_VERSION,
+					    sizeof(struct drbd_transport));
+	if (err)
+		destroy_workqueue(dtt_zc_wq);
+	return err;
 }
 
 static void __exit dtt_cleanup(void)
 {
 	drbd_unregister_transport_class(&tcp_transport_class);
+	destroy_workqueue(dtt_zc_wq);
 }
 
 module_init(dtt_initialize)
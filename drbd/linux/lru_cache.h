@@ -250,6 +250,8 @@ extern struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr);
 extern unsigned int lc_put(struct lru_cache *lc, struct lc_element *e);
 extern void lc_committed(struct lru_cache *lc);
+extern void lc_committed_list(struct lru_cache *lc, struct list_head *changes);
+extern unsigned int lc_take_pending(struct lru_cache *lc, struct list_head *changes);
 
 struct seq_file;
 extern void lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc);
@@ -505,28 +505,65 @@ struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr)
 }
 
 /**
- * lc_committed - tell @lc that pending changes have been recorded
+ * lc_committed_list - tell @lc that the changes on @changes have been recorded
  * @lc: the lru cache to operate on
+ * @changes: elements previously detached with lc_take_pending()
  *
- * User is expected to serialize on explicit lc_try_lock_for_transaction()
- * before the transaction is started, and later needs to lc_unlock() explicitly
- * as well.
+ * Like lc_committed(), but for a set of changes that has been taken
+ * off the to_be_changed list earlier, while other changes may already be
+ * accumulating for the next transaction.  Caller has to serialize with
+ * lc_get() etc, and commit detached change sets in the order they were taken.
  */
-void lc_committed(struct lru_cache *lc)
+void lc_committed_list(struct lru_cache *lc, struct list_head *changes)
 {
 	struct lc_element *e, *tmp;
 
 	PARANOIA_ENTRY();
-	list_for_each_entry_safe(e, tmp, &lc->to_be_changed, list) {
+	list_for_each_entry_safe(e, tmp, changes, list) {
 		/* count number of changes, not number of transactions */
 		++lc->changed;
 		e->lc_number = e->lc_new_number;
 		list_move(&e->list, &lc->in_use);
 	}
-	lc->pending_changes = 0;
 	RETURN();
 }
 
+/**
+ * lc_committed - tell @lc that pending changes have been recorded
+ * @lc: the lru cache to operate on
+ *
+ * User is expected to serialize on explicit lc_try_lock_for_transaction()
+ * before the transaction is started, and later needs to lc_unlock() explicitly
+ * as well.
+ */
+void lc_committed(struct lru_cache *lc)
+{
+	lc_committed_list(lc, &lc->to_be_changed);
+	lc->pending_changes = 0;
+}
+
+/**
+ * lc_take_pending - detach the pending changes from @lc
+ * @lc: the lru cache to operate on
+ * @changes: list to move the pending changes to
+ *
+ * User is expected to hold the transaction lock, see
+ * lc_try_lock_for_transaction().  The detached elements stay "uncommitted":
+ * they keep their refcnt, lc_get() still refuses to hand them out, and they
+ * can not be evicted, until lc_committed_list() is called on @changes.
+ * After lc_unlock(), the next set of changes may accumulate meanwhile.
+ * Returns the number of detached changes.
+ */
+unsigned int lc_take_pending(struct lru_cache *lc, struct list_head *changes)
+{
+	unsigned int n;
+
+	PARANOIA_ENTRY();
+	list_splice_tail_init(&lc->to_be_changed, changes);
+	n = lc->pending_changes;
+	lc->pending_changes = 0;
+	RETURN(n);
+}
 
 /**
  * lc_put - give up refcnt of @e